@@ -15,7 +15,7 @@ CONFIG         += warn_on \                     # Show all warnings.
                   debug_and_release build_all \ # Build debug and release version of the lib.
                   silent                        # Build silent.
                   c++11
-LIBS           += -lmosquitto
+LIBS           += -lmosquitto -lz
 
 # MACOSX SPECIFIC SETTINGS #############################################################################################
 macx:CONFIG += lib_bundle                       # Create the GDF2 library as a framework for easy deployment.
@@ -38,9 +38,19 @@ DESTDIR         = ./build/lib                   # Library files output folder.
 
 
 # FILES ################################################################################################################
-HEADERS        +=   source/qtmosquitto.hpp
-
-SOURCES        +=   source/qtmosquitto.cpp
+HEADERS        +=   source/qtmosquitto.hpp \
+                    source/qtmosquittopool.hpp \
+                    source/qtmosquittospool.hpp \
+                    source/qtmosquittocodec.hpp \
+                    source/qtmosquittostream.hpp \
+                    source/qtmosquittorecorder.hpp
+
+SOURCES        +=   source/qtmosquitto.cpp \
+                    source/qtmosquittopool.cpp \
+                    source/qtmosquittospool.cpp \
+                    source/qtmosquittocodec.cpp \
+                    source/qtmosquittostream.cpp \
+                    source/qtmosquittorecorder.cpp
 
 
 # INSTALLATION #########################################################################################################
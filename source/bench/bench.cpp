@@ -0,0 +1,496 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#include <QtCore>
+
+#include <algorithm>
+#include <cstring>
+
+#include <mosquitto.h>
+
+#include "../qtmosquitto.hpp"
+#include "../qtmosquittocodec.hpp"
+#include "../qtmosquittospool.hpp"
+
+/// Reaches the client's receive callback without a broker.
+class QtMosquittoClientBench
+{
+  public:
+    static void receive(QtMosquittoClient& client, const mosquitto_message& msg)
+    {
+      QtMosquittoClient::message_cb_s(0, &client, &msg);
+    }
+};
+
+namespace
+{
+  /// Monotonic clock shared by publishers and subscribers for latency samples.
+  QElapsedTimer benchClock;
+
+  /// Results are accumulated here so the compiler cannot drop the work.
+  volatile qint64 sink = 0;
+
+  struct Result
+  {
+    QString name;
+    QJsonObject params;
+    qint64 ops;
+    qint64 nsecs;
+    QVector<qint64> latencies;
+
+    Result(const QString& n, const QJsonObject& p = QJsonObject()):name(n),params(p),ops(0),nsecs(0),latencies(){}
+  };
+
+  /// Print a result as one line of JSON on stdout.
+  void report(Result& result)
+  {
+    QJsonObject obj(result.params);
+    obj.insert("benchmark", result.name);
+    obj.insert("ops", static_cast<double>(result.ops));
+    obj.insert("seconds", result.nsecs / 1e9);
+    obj.insert("ops_per_sec", (result.nsecs > 0) ? (result.ops * 1e9 / result.nsecs) : 0.0);
+    if (result.latencies.isEmpty())
+    {
+      obj.insert("ns_per_op", (result.ops > 0) ? (static_cast<double>(result.nsecs) / result.ops) : 0.0);
+    }
+    else
+    {
+      std::sort(result.latencies.begin(), result.latencies.end());
+      const int n = result.latencies.size();
+      obj.insert("p50_us", result.latencies.at(qMin(n - 1, n * 50 / 100)) / 1000.0);
+      obj.insert("p99_us", result.latencies.at(qMin(n - 1, n * 99 / 100)) / 1000.0);
+      obj.insert("p999_us", result.latencies.at(qMin(n - 1, n * 999 / 1000)) / 1000.0);
+      obj.insert("max_us", result.latencies.last() / 1000.0);
+    }
+    QTextStream out(stdout);
+    out << QJsonDocument(obj).toJson(QJsonDocument::Compact) << endl;
+  }
+
+  template <typename Func>
+  void micro(const QString& name, qint64 iterations, Func func)
+  {
+    Result result(name);
+    QElapsedTimer timer;
+    timer.start();
+    for (qint64 i = 0; i < iterations; ++i)
+    {
+      func();
+    }
+    result.nsecs = timer.nsecsElapsed();
+    result.ops = iterations;
+    report(result);
+  }
+
+  /// Run the event loop until cond is true or the timeout expires.
+  template <typename Cond>
+  bool waitFor(Cond cond, int timeout)
+  {
+    QElapsedTimer timer;
+    timer.start();
+    while (!cond())
+    {
+      if (timer.elapsed() > timeout)
+      {
+        return false;
+      }
+      QCoreApplication::processEvents(QEventLoop::AllEvents, 5);
+    }
+    return true;
+  }
+
+  /// Receives queued messages in another thread.
+  struct Counter
+  {
+    QAtomicInt received;
+    Counter():received(0){}
+  };
+
+  ////////////////////////////////////////////////////////////////////////////
+  // Wrapper hot paths, no broker needed.
+
+  void runMicro(qint64 iterations)
+  {
+    const QString topic(QStringLiteral("bench/telemetry/device/42/temperature"));
+    const QByteArray rawTopic(topic.toUtf8());
+    const QByteArray payload(1024, 'x');
+
+    micro("topic_encode_qstring", iterations, [&]() {
+      sink += topic.toUtf8().size();
+    });
+
+    const QtMosquittoTopic prepared(topic);
+    micro("topic_encode_prepared", iterations, [&]() {
+      sink += prepared.utf8().size();
+    });
+
+    micro("message_convert_legacy", iterations, [&]() {
+      const QString t(QString::fromUtf8(rawTopic.constData()));
+      const QByteArray p(payload.constData(), payload.size());
+      sink += t.size() + p.size();
+    });
+
+    QtMosquittoClient client;
+
+    // The real receive path, from the libmosquitto callback to messageReceived
+    {
+      QByteArray topicBuffer(rawTopic);
+      QByteArray payloadBuffer(payload);
+      mosquitto_message raw;
+      std::memset(&raw, 0, sizeof(raw));
+      raw.topic = topicBuffer.data();
+      raw.payload = payloadBuffer.data();
+      raw.payloadlen = payloadBuffer.size();
+
+      QObject context;
+      QObject::connect(&client, &QtMosquittoClient::messageReceived, &context, [](const QtMosquittoMessage& m) {
+        sink += m.topic().size() + m.payload().size();
+      });
+      micro("message_receive_callback", iterations, [&]() {
+        QtMosquittoClientBench::receive(client, raw);
+      });
+      client.setTopicCacheSize(1024);
+      micro("message_receive_callback_topic_cache", iterations, [&]() {
+        QtMosquittoClientBench::receive(client, raw);
+      });
+      client.setTopicCacheSize(0);
+    }
+
+    // The real publish path of an unconnected client, QoS 1 messages are
+    // encoded and queued in the spool
+    {
+      QTemporaryDir dir;
+      QtMosquittoSpool spool;
+      if (dir.isValid() && spool.open(dir.filePath("bench.spool")))
+      {
+        spool.setOverflowPolicy(QtMosquittoSpool::DropOldest);
+        QtMosquittoZlibCodec codec(1);
+        QtMosquittoClient publisher;
+        publisher.setSpool(&spool);
+        micro("publish_spooled", iterations, [&]() {
+          sink += publisher.publish(prepared, payload, 1);
+        });
+        publisher.setPublishCodec(topic, &codec);
+        micro("publish_spooled_zlib", iterations, [&]() {
+          sink += publisher.publish(prepared, payload, 1);
+        });
+        publisher.setPublishCodec(topic, 0);
+        publisher.setSpool(0);
+      }
+      else
+      {
+        qWarning() << "runMicro: Failed to open a spool, skipping publish benchmarks";
+      }
+    }
+
+    const QtMosquittoMessage msg(rawTopic, payload);
+
+    {
+      QObject context;
+      QObject::connect(&client, &QtMosquittoClient::messageReceived, &context, [](const QtMosquittoMessage& m) {
+        sink += m.payload().size();
+      });
+      micro("signal_message_received_direct", iterations, [&]() {
+        emit client.messageReceived(msg);
+      });
+    }
+
+    {
+      QObject context;
+      QObject::connect(&client, &QtMosquittoClient::message, &context, [](const QString& t, const QByteArray& p) {
+        sink += t.size() + p.size();
+      });
+      micro("signal_message_legacy_direct", iterations, [&]() {
+        emit client.message(msg.topicString(), msg.payload());
+      });
+    }
+
+    // Cross thread hand-off, one event per message against one per batch
+    {
+      QThread thread;
+      QObject receiver;
+      receiver.moveToThread(&thread);
+      thread.start();
+      Counter counter;
+      QMetaObject::Connection conn = QObject::connect(&client, &QtMosquittoClient::messageReceived, &receiver,
+        [&counter](const QtMosquittoMessage&) { counter.received.fetchAndAddRelaxed(1); }, Qt::QueuedConnection);
+      Result result("signal_message_received_queued");
+      QElapsedTimer timer;
+      timer.start();
+      for (qint64 i = 0; i < iterations; ++i)
+      {
+        emit client.messageReceived(msg);
+      }
+      while (counter.received.load() < iterations)
+      {
+        QThread::yieldCurrentThread();
+      }
+      result.nsecs = timer.nsecsElapsed();
+      result.ops = iterations;
+      report(result);
+      QObject::disconnect(conn);
+
+      const int batchSize = 256;
+      const QVector<QtMosquittoMessage> batch(batchSize, msg);
+      counter.received.store(0);
+      conn = QObject::connect(&client, &QtMosquittoClient::messages, &receiver,
+        [&counter](const QVector<QtMosquittoMessage>& b) { counter.received.fetchAndAddRelaxed(b.size()); }, Qt::QueuedConnection);
+      const qint64 batches = qMax(Q_INT64_C(1), iterations / batchSize);
+      Result batched("signal_messages_batched_queued");
+      batched.params.insert("batch", batchSize);
+      timer.start();
+      for (qint64 i = 0; i < batches; ++i)
+      {
+        emit client.messages(batch);
+      }
+      while (counter.received.load() < batches * batchSize)
+      {
+        QThread::yieldCurrentThread();
+      }
+      batched.nsecs = timer.nsecsElapsed();
+      batched.ops = batches * batchSize;
+      report(batched);
+      QObject::disconnect(conn);
+
+      thread.quit();
+      thread.wait();
+    }
+
+    micro("process_tick_idle", iterations / 10, [&]() {
+      QMetaObject::invokeMethod(&client, "process", Qt::DirectConnection);
+    });
+  }
+
+  ////////////////////////////////////////////////////////////////////////////
+  // End to end against a local broker.
+
+  /// Run a mosquitto broker on loopback for the lifetime of the object.
+  class Broker
+  {
+    public:
+      Broker():mProcess(){}
+
+      ~Broker()
+      {
+        if (mProcess.state() != QProcess::NotRunning)
+        {
+          mProcess.terminate();
+          if (!mProcess.waitForFinished(2000))
+          {
+            mProcess.kill();
+            mProcess.waitForFinished(2000);
+          }
+        }
+      }
+
+      bool start(const QString& program, int port)
+      {
+        mProcess.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        mProcess.start(program, QStringList() << "-p" << QString::number(port));
+        if (!mProcess.waitForStarted(5000))
+        {
+          return false;
+        }
+        // Give the broker time to bind before clients connect
+        QThread::msleep(500);
+        return mProcess.state() == QProcess::Running;
+      }
+
+    private:
+      QProcess mProcess;
+  };
+
+  struct Scenario
+  {
+    QString name;
+    int qos;
+    int payloadSize;
+    int publishers;
+    int subscribers;
+    int messages;  ///< Per publisher.
+  };
+
+  QtMosquittoClient* newClient(QObject* parent, int port, QList<QtMosquittoClient*>& clients)
+  {
+    QtMosquittoClient* client = new QtMosquittoClient(QString(), true, parent);
+    client->setIoMode(QtMosquittoClient::NotifierIo);
+    client->setInflightWatermarks(1000, 500);
+    client->setRejectOnBackpressure(true);
+    client->setMaxInflightMessages(1000);
+    client->doConnect("127.0.0.1", port);
+    clients.append(client);
+    return client;
+  }
+
+  bool runScenario(const Scenario& scenario, int port)
+  {
+    QObject owner;
+    QList<QtMosquittoClient*> clients;
+    QList<QtMosquittoClient*> subscribers;
+    QList<QtMosquittoClient*> publishers;
+    int connected = 0;
+
+    for (int i = 0; i < scenario.subscribers + scenario.publishers; ++i)
+    {
+      QtMosquittoClient* client = newClient(&owner, port, clients);
+      QObject::connect(client, &QtMosquittoClient::connected, [&connected]() { ++connected; });
+      ((i < scenario.subscribers) ? subscribers : publishers).append(client);
+    }
+    if (!waitFor([&]() { return connected == clients.size(); }, 10000))
+    {
+      qWarning() << "bench: Clients failed to connect for" << scenario.name;
+      return false;
+    }
+
+    QJsonObject params;
+    params.insert("qos", scenario.qos);
+    params.insert("payload", scenario.payloadSize);
+    params.insert("publishers", scenario.publishers);
+    params.insert("subscribers", scenario.subscribers);
+    Result result(QStringLiteral("e2e_") + scenario.name, params);
+    const qint64 expected = static_cast<qint64>(scenario.messages) * scenario.publishers * scenario.subscribers;
+    result.latencies.reserve(expected);
+
+    const QString prefix(QStringLiteral("bench/") + scenario.name);
+    QList<QFuture<int> > subacks;
+    foreach (QtMosquittoClient* sub, subscribers)
+    {
+      QObject::connect(sub, &QtMosquittoClient::messageReceived, [&result](const QtMosquittoMessage& msg) {
+        qint64 sent = 0;
+        memcpy(&sent, msg.payload().constData(), sizeof(sent));
+        result.latencies.append(benchClock.nsecsElapsed() - sent);
+      });
+      subacks.append(sub->subscribeAsync(prefix + "/#", scenario.qos));
+    }
+    if (!waitFor([&]() {
+          foreach (const QFuture<int>& f, subacks) { if (!f.isFinished()) return false; }
+          return true;
+        }, 10000))
+    {
+      qWarning() << "bench: Subscribe failed for" << scenario.name;
+      return false;
+    }
+
+    QVector<QtMosquittoTopic> topics;
+    for (int i = 0; i < publishers.size(); ++i)
+    {
+      topics.append(QtMosquittoTopic(prefix + "/" + QString::number(i)));
+    }
+    QVector<int> sent(publishers.size(), 0);
+    QByteArray payload(qMax(scenario.payloadSize, static_cast<int>(sizeof(qint64))), 'x');
+
+    // Publish in bursts from the event loop so subscribers can keep up
+    QTimer pump;
+    pump.setInterval(0);
+    QObject::connect(&pump, &QTimer::timeout, [&]() {
+      bool done = true;
+      for (int p = 0; p < publishers.size(); ++p)
+      {
+        for (int burst = 0; burst < 64 && sent[p] < scenario.messages; ++burst)
+        {
+          const qint64 now = benchClock.nsecsElapsed();
+          memcpy(payload.data(), &now, sizeof(now));
+          if (publishers[p]->publish(topics[p], payload, scenario.qos) < 0)
+          {
+            break;
+          }
+          ++sent[p];
+        }
+        done = done && (sent[p] == scenario.messages);
+      }
+      if (done)
+      {
+        pump.stop();
+      }
+    });
+
+    QElapsedTimer timer;
+    timer.start();
+    pump.start();
+    const bool complete = waitFor([&]() { return result.latencies.size() >= expected; }, 60000);
+    result.nsecs = timer.nsecsElapsed();
+    result.ops = result.latencies.size();
+    result.params.insert("complete", complete);
+    report(result);
+
+    foreach (QtMosquittoClient* client, clients)
+    {
+      client->doDisconnect();
+    }
+    waitFor([]() { return false; }, 100);
+    return complete;
+  }
+
+  void runEndToEnd(const QString& brokerProgram, int port, int messages)
+  {
+    Broker broker;
+    if (!broker.start(brokerProgram, port))
+    {
+      qWarning() << "bench: Could not start broker" << brokerProgram << "- skipping end to end scenarios";
+      return;
+    }
+
+    QList<Scenario> scenarios;
+    const int payloadSizes[] = { 16, 1024, 65536 };
+    for (int qos = 0; qos <= 2; ++qos)
+    {
+      for (int i = 0; i < 3; ++i)
+      {
+        const Scenario s = { QString("qos%1_%2b").arg(qos).arg(payloadSizes[i]), qos, payloadSizes[i], 1, 1,
+                             (payloadSizes[i] > 1024) ? messages / 10 : messages };
+        scenarios.append(s);
+      }
+      const Scenario fanOut = { QString("qos%1_fan_out").arg(qos), qos, 256, 1, 4, messages / 4 };
+      const Scenario fanIn = { QString("qos%1_fan_in").arg(qos), qos, 256, 4, 1, messages / 4 };
+      scenarios.append(fanOut);
+      scenarios.append(fanIn);
+    }
+
+    foreach (const Scenario& scenario, scenarios)
+    {
+      runScenario(scenario, port);
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  QCoreApplication app(argc, argv);
+  QtMosquittoApp mapp;
+  benchClock.start();
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Measure QtMosquitto wrapper overhead and end to end throughput and latency.\n"
+                                   "Results are printed as one JSON object per line.");
+  parser.addHelpOption();
+  QCommandLineOption microOnly("micro-only", "Only run the benchmarks that do not need a broker.");
+  QCommandLineOption broker("broker", "Broker executable started for end to end scenarios.", "path", "mosquitto");
+  QCommandLineOption port("port", "Loopback port for the broker.", "port", "18883");
+  QCommandLineOption iterations("iterations", "Iterations of each micro benchmark.", "count", "1000000");
+  QCommandLineOption messages("messages", "Messages per publisher in end to end scenarios.", "count", "20000");
+  parser.addOption(microOnly);
+  parser.addOption(broker);
+  parser.addOption(port);
+  parser.addOption(iterations);
+  parser.addOption(messages);
+  parser.process(app);
+
+  runMicro(parser.value(iterations).toLongLong());
+  if (!parser.isSet(microOnly))
+  {
+    runEndToEnd(parser.value(broker), parser.value(port).toInt(), parser.value(messages).toInt());
+  }
+  return 0;
+}
@@ -0,0 +1,187 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#include "messagemodel.hpp"
+
+namespace
+{
+  // Longest part of a payload converted for display in a cell
+  const int payloadDisplayLength = 256;
+}
+
+MessageModel::MessageModel(int capacity, QObject* par) :
+  QAbstractTableModel(par),
+  mRing(qMax(1, capacity)),
+  mHead(0),
+  mCount(0),
+  mPending(),
+  mFlushTimer(),
+  mPaused(false),
+  mFilter(),
+  mReceived(0)
+{
+  mFlushTimer.setSingleShot(true);
+  mFlushTimer.setInterval(100);
+  connect(&mFlushTimer, SIGNAL(timeout()), this, SLOT(flush()));
+}
+
+MessageModel::~MessageModel()
+{
+}
+
+int MessageModel::rowCount(const QModelIndex& par) const
+{
+  return par.isValid() ? 0 : mCount;
+}
+
+int MessageModel::columnCount(const QModelIndex& par) const
+{
+  return par.isValid() ? 0 : ColumnCount;
+}
+
+QVariant MessageModel::data(const QModelIndex& index, int role) const
+{
+  if (!index.isValid() || index.row() >= mCount || role != Qt::DisplayRole)
+  {
+    return QVariant();
+  }
+  const Entry& e = entry(index.row());
+  switch (index.column())
+  {
+    case TimeColumn:
+      return QDateTime::fromMSecsSinceEpoch(e.time).toString(QLatin1String("hh:mm:ss.zzz"));
+    case TopicColumn:
+      return e.message.topicString();
+    case PayloadColumn:
+    {
+      const QByteArray& payload = e.message.payload();
+      return QString::fromUtf8(payload.constData(), qMin(payload.size(), payloadDisplayLength));
+    }
+    default:
+      return QVariant();
+  }
+}
+
+QVariant MessageModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+  if (orientation != Qt::Horizontal || role != Qt::DisplayRole)
+  {
+    return QVariant();
+  }
+  switch (section)
+  {
+    case TimeColumn: return tr("Time");
+    case TopicColumn: return tr("Topic");
+    case PayloadColumn: return tr("Payload");
+    default: return QVariant();
+  }
+}
+
+quint64 MessageModel::received() const
+{
+  return mReceived;
+}
+
+void MessageModel::addMessages(const QVector<QtMosquittoMessage>& batch)
+{
+  mReceived += batch.size();
+  if (mPaused)
+  {
+    return;
+  }
+
+  const qint64 now = QDateTime::currentMSecsSinceEpoch();
+  for (int i = 0; i < batch.size(); ++i)
+  {
+    const QtMosquittoMessage& message = batch.at(i);
+    if (mFilter.isEmpty() || QtMosquittoClient::topicMatches(mFilter, message.topic()))
+    {
+      Entry e;
+      e.message = message;
+      e.time = now;
+      mPending.append(e);
+    }
+  }
+
+  // Only the newest messages up to the capacity can ever be shown
+  const int excess = mPending.size() - 2 * mRing.size();
+  if (excess > 0)
+  {
+    mPending.remove(0, excess);
+  }
+  if (!mPending.isEmpty() && !mFlushTimer.isActive())
+  {
+    mFlushTimer.start();
+  }
+}
+
+void MessageModel::setPaused(bool paused)
+{
+  mPaused = paused;
+}
+
+void MessageModel::setFilter(const QString& filter)
+{
+  mFilter = filter.trimmed().toUtf8();
+}
+
+void MessageModel::clear()
+{
+  beginResetModel();
+  mRing.fill(Entry());
+  mHead = 0;
+  mCount = 0;
+  mPending.clear();
+  mFlushTimer.stop();
+  endResetModel();
+}
+
+void MessageModel::flush()
+{
+  if (mPending.isEmpty())
+  {
+    return;
+  }
+
+  const int capacity = mRing.size();
+  const int added = qMin(mPending.size(), capacity);
+  const int first = mPending.size() - added;
+
+  // Oldest rows are at the bottom, drop them before their slots are reused
+  const int overflow = mCount + added - capacity;
+  if (overflow > 0)
+  {
+    beginRemoveRows(QModelIndex(), mCount - overflow, mCount - 1);
+    mCount -= overflow;
+    endRemoveRows();
+  }
+
+  beginInsertRows(QModelIndex(), 0, added - 1);
+  for (int i = first; i < mPending.size(); ++i)
+  {
+    mRing[mHead] = mPending.at(i);
+    mHead = (mHead + 1) % capacity;
+  }
+  mCount += added;
+  endInsertRows();
+  mPending.clear();
+}
+
+const MessageModel::Entry& MessageModel::entry(int row) const
+{
+  const int capacity = mRing.size();
+  return mRing.at((mHead - 1 - row + capacity) % capacity);
+}
@@ -0,0 +1,81 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#ifndef QTMOSQUITTO_DEMO_MESSAGEMODEL_HPP
+#define QTMOSQUITTO_DEMO_MESSAGEMODEL_HPP
+
+#include <QtCore>
+
+#include "../qtmosquitto.hpp"
+
+/** Table of the most recent messages, newest first.
+ * Messages are kept in a fixed size ring buffer and added to the model in
+ * batches from a timer, so the view is updated a few times per second no
+ * matter how fast messages arrive. Payloads are only converted to text for
+ * the rows the view asks for.
+ */
+class MessageModel : public QAbstractTableModel
+{
+  Q_OBJECT
+  public:
+    enum Column
+    {
+      TimeColumn,
+      TopicColumn,
+      PayloadColumn,
+      ColumnCount
+    };
+
+    MessageModel(int capacity = 10000, QObject* parent = 0);
+    virtual ~MessageModel();
+
+    virtual int rowCount(const QModelIndex& parent = QModelIndex()) const;
+    virtual int columnCount(const QModelIndex& parent = QModelIndex()) const;
+    virtual QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const;
+    virtual QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const;
+
+    /// Number of messages received, including those not shown.
+    quint64 received() const;
+
+  public slots:
+    void addMessages(const QVector<QtMosquittoMessage>& batch);
+    void setPaused(bool paused);
+    void setFilter(const QString& filter);
+    void clear();
+
+  private slots:
+    void flush();
+
+  private:
+    struct Entry
+    {
+      QtMosquittoMessage message;
+      qint64 time;
+    };
+
+    const Entry& entry(int row) const;
+
+    QVector<Entry> mRing;
+    int mHead;
+    int mCount;
+    QVector<Entry> mPending;
+    QTimer mFlushTimer;
+    bool mPaused;
+    QByteArray mFilter;
+    quint64 mReceived;
+};
+
+#endif
@@ -15,6 +15,7 @@ Contributors:
 */
 
 #include "window.hpp"
+#include "messagemodel.hpp"
 
 Window::Window(QWidget* par) :
   QWidget(par),
@@ -23,14 +24,23 @@ Window::Window(QWidget* par) :
   mUsernameEdit(new QLineEdit()),
   mPasswordEdit(new QLineEdit()),
   mSubscribeEdit(new QLineEdit()),
+  mConflateSpin(new QSpinBox()),
   mPublishTopicEdit(new QLineEdit()),
   mPublishPayloadEdit(new QLineEdit()),
-  mMessageTable(new QTableWidget())
+  mMessageModel(new MessageModel(10000, this)),
+  mMessageView(new QTableView()),
+  mStatusLabel(new QLabel())
 {
   setWindowTitle(tr("QtMosquitto Demo"));
   resize(800, 600);
   
   mClient->setAutoReconnect(true);
+  // Run the network loop in its own thread and receive messages a burst at
+  // a time, topic strings are shared between messages instead of converted
+  // for each one.
+  mClient->setIoMode(QtMosquittoClient::ThreadedIo);
+  mClient->setBatchDelivery(1000, 20);
+  mClient->setTopicCacheSize(10000);
   
   
   QPushButton* connectButton = new QPushButton(tr("Connect"));
@@ -63,22 +73,45 @@ Window::Window(QWidget* par) :
   
   
   
+  // Fast topics would otherwise add a table row for every single message
+  mConflateSpin->setRange(0, 10000);
+  mConflateSpin->setSingleStep(100);
+  mConflateSpin->setSuffix(tr(" ms"));
+  mConflateSpin->setSpecialValueText(tr("Every message"));
+  mConflateSpin->setToolTip(tr("Show at most one message per topic in this interval"));
+
   QPushButton* subscribeButton = new QPushButton(tr("Subscribe"));
   QPushButton* unsubscribeButton = new QPushButton(tr("Unsubscribe"));
   QHBoxLayout* subscriptionLayout = new QHBoxLayout();
   subscriptionLayout->addWidget(new QLabel(tr("Topic")), 0);
   subscriptionLayout->addWidget(mSubscribeEdit, 1);
+  subscriptionLayout->addWidget(new QLabel(tr("Conflate")), 0);
+  subscriptionLayout->addWidget(mConflateSpin, 0);
   subscriptionLayout->addWidget(subscribeButton, 0);
   subscriptionLayout->addWidget(unsubscribeButton, 0);
   
   QGroupBox* subscriptionGroup = new QGroupBox(tr("Subscriptions"));
   subscriptionGroup->setLayout(subscriptionLayout);
   
-  mMessageTable->setColumnCount(2);
-  mMessageTable->setHorizontalHeaderLabels((QStringList() << tr("Topic") << tr("Payload")));
-  
+  mMessageView->setModel(mMessageModel);
+  mMessageView->setWordWrap(false);
+  mMessageView->verticalHeader()->hide();
+  mMessageView->verticalHeader()->setSectionResizeMode(QHeaderView::Fixed);
+  mMessageView->horizontalHeader()->setStretchLastSection(true);
+  mMessageView->setColumnWidth(MessageModel::TopicColumn, 250);
+
+  QCheckBox* pauseCheck = new QCheckBox(tr("Pause"));
+  QLineEdit* filterEdit = new QLineEdit();
+  filterEdit->setPlaceholderText(tr("Topic filter, e.g a/+/c"));
+  QHBoxLayout* messageControlLayout = new QHBoxLayout();
+  messageControlLayout->addWidget(pauseCheck, 0);
+  messageControlLayout->addWidget(new QLabel(tr("Filter")), 0);
+  messageControlLayout->addWidget(filterEdit, 1);
+  messageControlLayout->addWidget(mStatusLabel, 0);
+
   QVBoxLayout* messageLayout = new QVBoxLayout();
-  messageLayout->addWidget(mMessageTable);
+  messageLayout->addLayout(messageControlLayout);
+  messageLayout->addWidget(mMessageView);
   
   QGroupBox* messageGroup = new QGroupBox(tr("Messages"));
   messageGroup->setLayout(messageLayout);
@@ -101,7 +134,13 @@ Window::Window(QWidget* par) :
 
   connect(mClient, SIGNAL(connectState(bool)), connectButton, SLOT(setDisabled(bool)));
   connect(mClient, SIGNAL(connectState(bool)), disconnectButton, SLOT(setEnabled(bool)));
-  connect(mClient, SIGNAL(message(QString,QByteArray)), this, SLOT(message(QString,QByteArray)));
+  connect(mClient, SIGNAL(messages(QVector<QtMosquittoMessage>)), mMessageModel, SLOT(addMessages(QVector<QtMosquittoMessage>)));
+  connect(pauseCheck, SIGNAL(toggled(bool)), mMessageModel, SLOT(setPaused(bool)));
+  connect(filterEdit, SIGNAL(textChanged(QString)), mMessageModel, SLOT(setFilter(QString)));
+
+  QTimer* statusTimer = new QTimer(this);
+  connect(statusTimer, SIGNAL(timeout()), this, SLOT(updateStatus()));
+  statusTimer->start(1000);
 }
 
 Window::~Window()
@@ -110,7 +149,7 @@ Window::~Window()
 
 void Window::doConnect()
 {
-  mMessageTable->clearContents();
+  mMessageModel->clear();
   
   const QString server = mServerEdit->text().trimmed();
   const QString uname = mUsernameEdit->text().trimmed();
@@ -128,7 +167,9 @@ void Window::doSubscribe()
   if (!mClient->subscribe(topic))
   {
     QMessageBox::warning(this, tr("Subscribe"), tr("Subscribe failed"));
+    return;
   }
+  mClient->setConflation(topic, mConflateSpin->value());
 }
 
 void Window::doUnsubscribe()
@@ -138,6 +179,7 @@ void Window::doUnsubscribe()
   {
     QMessageBox::warning(this, tr("Unsubscribe"), tr("Unsubscribe failed"));
   }
+  mClient->setConflation(topic, 0);
 }
 
 void Window::doPublish()
@@ -151,13 +193,9 @@ void Window::doPublish()
   }
 }
 
-void Window::message(const QString& topic, const QByteArray& payload)
+void Window::updateStatus()
 {
-  qDebug() << "Window::message" << topic << payload;
-  mMessageTable->insertRow(0);
-  mMessageTable->setItem(0, 0, new QTableWidgetItem(topic));
-  mMessageTable->setItem(0, 1, new QTableWidgetItem(QString::fromUtf8(payload)));
-  mMessageTable->setVerticalHeaderItem(0, new QTableWidgetItem(QDateTime::currentDateTime().toString(Qt::DefaultLocaleShortDate)));
+  mStatusLabel->setText(tr("%1 received").arg(mMessageModel->received()));
 }
 
 
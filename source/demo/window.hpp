@@ -21,6 +21,8 @@ Contributors:
 
 #include "../qtmosquitto.hpp"
 
+class MessageModel;
+
 class Window : public QWidget
 {
   Q_OBJECT
@@ -33,8 +35,7 @@ class Window : public QWidget
     void doSubscribe();
     void doUnsubscribe();
     void doPublish();
-    
-    void message(const QString& topic, const QByteArray& payload);
+    void updateStatus();
   
   
   
@@ -44,9 +45,12 @@ class Window : public QWidget
     QLineEdit* mUsernameEdit;
     QLineEdit* mPasswordEdit;
     QLineEdit* mSubscribeEdit;
+    QSpinBox* mConflateSpin;
     QLineEdit* mPublishTopicEdit;
     QLineEdit* mPublishPayloadEdit;
-    QTableWidget* mMessageTable;
+    MessageModel* mMessageModel;
+    QTableView* mMessageView;
+    QLabel* mStatusLabel;
 };
 
 #endif
@@ -16,8 +16,34 @@ Contributors:
 */
 
 #include "qtmosquitto.hpp"
+#include "qtmosquittospool.hpp"
+#include "qtmosquittocodec.hpp"
+#include "qtmosquittostream.hpp"
+#include "qtmosquittorecorder.hpp"
 
 #include <mosquitto.h>
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+#include <mqtt_protocol.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <list>
+#include <random>
+
+Q_LOGGING_CATEGORY(lcMosquitto, "qtmosquitto")
+
+namespace
+{
+  // Start of the QtMosquittoCodec header, followed by the ID and decoded size
+  const char codecMagic[3] = { '\xFE', 'Q', 'M' };
+  // Largest payload MQTT can carry, decoded sizes above it are not trusted
+  const quint32 maxPayloadSize = 268435455;
+  // Most packets read per socket notification, so a flood can not starve the event loop
+  const int maxReadsPerNotify = 1000;
+}
 
 QtMosquittoApp::QtMosquittoApp()
 {
@@ -31,14 +57,1021 @@ QtMosquittoApp::~QtMosquittoApp()
 
 ////////////////////////////////////////////////////////////////////////////////
 
+QtMosquittoMessage::QtMosquittoMessage() :
+  mTopic(),
+  mTopicString(),
+  mPayload(),
+  mTopicId(-1),
+  mMid(0),
+  mQos(0),
+  mRetain(false)
+{
+}
+
+QtMosquittoMessage::QtMosquittoMessage(const QByteArray& topic, const QByteArray& payload, int qos, bool retain, int mid) :
+  mTopic(topic),
+  mTopicString(),
+  mPayload(payload),
+  mTopicId(-1),
+  mMid(mid),
+  mQos(qos),
+  mRetain(retain)
+{
+}
+
+QString QtMosquittoMessage::topicString() const
+{
+  return mTopicString.isNull() ? QString::fromUtf8(mTopic) : mTopicString;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+QtMosquittoMetrics::QtMosquittoMetrics() :
+  messagesIn(0),
+  bytesIn(0),
+  messagesOut(0),
+  bytesOut(0),
+  publishFailures(0),
+  reconnects(0),
+  disconnects(0),
+  conflationDropped(0),
+  conflationMerged(0),
+  queueDropped(0),
+  decodeRejected(0),
+  incomingDropped(0),
+  laneDropped(0)
+{
+  for (int i = 0; i < HistogramBuckets; ++i)
+  {
+    loopTime[i] = 0;
+    deliveryLatency[i] = 0;
+  }
+}
+
+quint64 QtMosquittoMetrics::percentile(const quint64* histogram, double fraction)
+{
+  quint64 total = 0;
+  for (int i = 0; i < HistogramBuckets; ++i)
+  {
+    total += histogram[i];
+  }
+  const quint64 target = static_cast<quint64>(total * fraction);
+  quint64 count = 0;
+  for (int i = 0; i < HistogramBuckets; ++i)
+  {
+    count += histogram[i];
+    if (count > target)
+    {
+      return Q_UINT64_C(1) << i;
+    }
+  }
+  return Q_UINT64_C(1) << (HistogramBuckets - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+QtMosquittoProperties::QtMosquittoProperties() :
+  messageExpiry(0),
+  userProperties()
+{
+}
+
+bool QtMosquittoProperties::isEmpty() const
+{
+  return messageExpiry <= 0 && userProperties.isEmpty();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+QtMosquittoReconnectPolicy::QtMosquittoReconnectPolicy() :
+  initialDelay(1000),
+  maxDelay(60000),
+  multiplier(2.0),
+  jitter(true),
+  maxAttempts(0),
+  restoreSubscriptions(true)
+{
+}
+
+int QtMosquittoReconnectPolicy::delayBound(int attempt) const
+{
+  double bound = qMax(0, initialDelay);
+  for (int i = 1; i < attempt && bound < maxDelay; ++i)
+  {
+    bound *= multiplier;
+  }
+  return static_cast<int>(qBound(0.0, bound, static_cast<double>(maxDelay)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+QtMosquittoTopic::QtMosquittoTopic() :
+  mTopic(),
+  mValid(false)
+{
+}
+
+QtMosquittoTopic::QtMosquittoTopic(const QString& topic) :
+  mTopic(topic.toUtf8()),
+  mValid(!mTopic.isEmpty() && mosquitto_pub_topic_check(mTopic.constData()) == MOSQ_ERR_SUCCESS)
+{
+}
+
+QtMosquittoTopic::QtMosquittoTopic(const QByteArray& topic) :
+  mTopic(topic),
+  mValid(!mTopic.isEmpty() && mosquitto_pub_topic_check(mTopic.constData()) == MOSQ_ERR_SUCCESS)
+{
+}
+
+QString QtMosquittoTopic::name() const
+{
+  return QString::fromUtf8(mTopic);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  /// Bounded LRU table interning UTF-8 topics, shared by the owner and network threads.
+  class TopicCache
+  {
+    public:
+      struct Entry
+      {
+        QByteArray topic;
+        QString string;
+        int id;
+
+        Entry():topic(),string(),id(-1){}
+      };
+
+      TopicCache():mEnabled(0),mMutex(),mMaxSize(0),mNextId(0),mLru(),mTopics(),mIds(){}
+
+      void setMaxSize(int maxSize)
+      {
+        QMutexLocker lock(&mMutex);
+        mMaxSize = qMax(0, maxSize);
+        mEnabled.store(mMaxSize > 0 ? 1 : 0);
+        evict();
+      }
+
+      int maxSize() const
+      {
+        QMutexLocker lock(&mMutex);
+        return mMaxSize;
+      }
+
+      /** Find or add a topic.
+       * \param topic  Topic bytes, may be a QByteArray::fromRawData view.
+       * \returns True if the cache is enabled and entry was filled in.
+       */
+      bool intern(const QByteArray& topic, Entry& entry)
+      {
+        if (!mEnabled.load())
+        {
+          return false;
+        }
+        QMutexLocker lock(&mMutex);
+        if (mMaxSize == 0)
+        {
+          return false;
+        }
+
+        const QHash<QByteArray, List::iterator>::const_iterator found = mTopics.constFind(topic);
+        if (found != mTopics.constEnd())
+        {
+          mLru.splice(mLru.begin(), mLru, found.value());
+          entry = mLru.front();
+          return true;
+        }
+
+        Entry added;
+        added.topic = QByteArray(topic.constData(), topic.size());
+        added.string = QString::fromUtf8(added.topic);
+        added.id = mNextId++;
+        mLru.push_front(added);
+        mTopics.insert(added.topic, mLru.begin());
+        mIds.insert(added.id, mLru.begin());
+        evict();
+        entry = added;
+        return true;
+      }
+
+      QString find(int id) const
+      {
+        QMutexLocker lock(&mMutex);
+        const QHash<int, List::iterator>::const_iterator found = mIds.constFind(id);
+        return (found != mIds.constEnd()) ? found.value()->string : QString();
+      }
+
+    private:
+      typedef std::list<Entry> List;
+
+      void evict()
+      {
+        while (mLru.size() > static_cast<size_t>(mMaxSize))
+        {
+          mTopics.remove(mLru.back().topic);
+          mIds.remove(mLru.back().id);
+          mLru.pop_back();
+        }
+      }
+
+      QAtomicInt mEnabled;
+      mutable QMutex mMutex;
+      int mMaxSize;
+      int mNextId;
+      List mLru;
+      QHash<QByteArray, List::iterator> mTopics;
+      QHash<int, List::iterator> mIds;
+  };
+}
+
+namespace
+{
+  /** Trie of topic filters split on level separators.
+   * Values are attached to the node of their filter, match() walks a topic
+   * once and visits the values of every filter matching it.
+   */
+  template <typename T>
+  class TopicTrie
+  {
+    public:
+      TopicTrie():mRoot(){}
+
+      bool isEmpty() const
+      {
+        return mRoot.children.isEmpty() && mRoot.values.isEmpty();
+      }
+
+      void insert(const QByteArray& filter, const T& value)
+      {
+        Node* node = &mRoot;
+        int pos = 0;
+        while (pos <= filter.size())
+        {
+          const int end = levelEnd(filter, pos);
+          const QByteArray level(filter.mid(pos, end - pos));
+          Node*& child = node->children[level];
+          if (!child)
+          {
+            child = new Node();
+          }
+          node = child;
+          pos = end + 1;
+        }
+        node->values.append(value);
+      }
+
+      bool remove(const QByteArray& filter, const T& value)
+      {
+        return remove(&mRoot, filter, 0, value);
+      }
+
+      template <typename Func>
+      void match(const QByteArray& topic, Func func) const
+      {
+        match(&mRoot, topic, 0, func);
+      }
+
+    private:
+      struct Node
+      {
+        QHash<QByteArray, Node*> children;
+        QList<T> values;
+
+        Node():children(),values(){}
+        ~Node() { qDeleteAll(children); }
+      };
+
+      static int levelEnd(const QByteArray& str, int pos)
+      {
+        const int end = str.indexOf('/', pos);
+        return (end < 0) ? str.size() : end;
+      }
+
+      static bool remove(Node* node, const QByteArray& filter, int pos, const T& value)
+      {
+        if (pos > filter.size())
+        {
+          return node->values.removeOne(value);
+        }
+        const int end = levelEnd(filter, pos);
+        const QByteArray level(QByteArray::fromRawData(filter.constData() + pos, end - pos));
+        typename QHash<QByteArray, Node*>::iterator found = node->children.find(level);
+        if (found == node->children.end() || !remove(found.value(), filter, end + 1, value))
+        {
+          return false;
+        }
+        if (found.value()->children.isEmpty() && found.value()->values.isEmpty())
+        {
+          delete found.value();
+          node->children.erase(found);
+        }
+        return true;
+      }
+
+      template <typename Func>
+      static void match(const Node* node, const QByteArray& topic, int pos, Func& func)
+      {
+        // Wildcards at the first level must not match topics beginning with $
+        const bool wildcards = !(pos == 0 && topic.startsWith('$'));
+        if (wildcards)
+        {
+          // # also matches the parent level, so a/# matches a
+          const Node* multi = node->children.value(QByteArray::fromRawData("#", 1));
+          if (multi)
+          {
+            visit(multi, func);
+          }
+        }
+        if (pos > topic.size())
+        {
+          visit(node, func);
+          return;
+        }
+
+        const int end = levelEnd(topic, pos);
+        const Node* exact = node->children.value(QByteArray::fromRawData(topic.constData() + pos, end - pos));
+        if (exact)
+        {
+          match(exact, topic, end + 1, func);
+        }
+        if (wildcards)
+        {
+          const Node* single = node->children.value(QByteArray::fromRawData("+", 1));
+          if (single)
+          {
+            match(single, topic, end + 1, func);
+          }
+        }
+      }
+
+      template <typename Func>
+      static void visit(const Node* node, Func& func)
+      {
+        for (typename QList<T>::const_iterator it = node->values.constBegin(); it != node->values.constEnd(); ++it)
+        {
+          func(*it);
+        }
+      }
+
+      Node mRoot;
+      Q_DISABLE_COPY(TopicTrie)
+  };
+}
+
+namespace
+{
+  /** Set of topics split on level separators, queried with topic filters.
+   * This is the reverse of TopicTrie, which stores filters and is queried
+   * with topics.
+   */
+  class TopicIndex
+  {
+    public:
+      TopicIndex():mRoot(){}
+
+      void insert(const QByteArray& topic)
+      {
+        Node* node = &mRoot;
+        int pos = 0;
+        while (pos <= topic.size())
+        {
+          const int end = levelEnd(topic, pos);
+          Node*& child = node->children[topic.mid(pos, end - pos)];
+          if (!child)
+          {
+            child = new Node();
+          }
+          node = child;
+          pos = end + 1;
+        }
+        node->present = true;
+      }
+
+      void remove(const QByteArray& topic)
+      {
+        remove(&mRoot, topic, 0);
+      }
+
+      template <typename Func>
+      void match(const QByteArray& filter, Func func) const
+      {
+        match(&mRoot, filter, 0, QByteArray(), func);
+      }
+
+    private:
+      struct Node
+      {
+        QHash<QByteArray, Node*> children;
+        bool present;
+
+        Node():children(),present(false){}
+        ~Node() { qDeleteAll(children); }
+      };
+
+      static int levelEnd(const QByteArray& str, int pos)
+      {
+        const int end = str.indexOf('/', pos);
+        return (end < 0) ? str.size() : end;
+      }
+
+      static QByteArray join(const QByteArray& path, int pos, const QByteArray& level)
+      {
+        return (pos == 0) ? level : (path + '/' + level);
+      }
+
+      static bool remove(Node* node, const QByteArray& topic, int pos)
+      {
+        if (pos > topic.size())
+        {
+          node->present = false;
+          return true;
+        }
+        const int end = levelEnd(topic, pos);
+        const QByteArray level(QByteArray::fromRawData(topic.constData() + pos, end - pos));
+        QHash<QByteArray, Node*>::iterator found = node->children.find(level);
+        if (found == node->children.end() || !remove(found.value(), topic, end + 1))
+        {
+          return false;
+        }
+        if (found.value()->children.isEmpty() && !found.value()->present)
+        {
+          delete found.value();
+          node->children.erase(found);
+        }
+        return true;
+      }
+
+      template <typename Func>
+      static void match(const Node* node, const QByteArray& filter, int pos, const QByteArray& path, Func& func)
+      {
+        if (pos > filter.size())
+        {
+          if (node->present)
+          {
+            func(path);
+          }
+          return;
+        }
+        const int end = levelEnd(filter, pos);
+        const QByteArray level(QByteArray::fromRawData(filter.constData() + pos, end - pos));
+        // Wildcards at the first level must not match topics beginning with $
+        if (level == "#")
+        {
+          // # also matches the parent level, so a/# matches a
+          if (node->present && pos != 0)
+          {
+            func(path);
+          }
+          visit(node, pos, path, func);
+        }
+        else if (level == "+")
+        {
+          for (QHash<QByteArray, Node*>::const_iterator it = node->children.constBegin(); it != node->children.constEnd(); ++it)
+          {
+            if (pos != 0 || !it.key().startsWith('$'))
+            {
+              match(it.value(), filter, end + 1, join(path, pos, it.key()), func);
+            }
+          }
+        }
+        else
+        {
+          const Node* child = node->children.value(level);
+          if (child)
+          {
+            match(child, filter, end + 1, join(path, pos, level), func);
+          }
+        }
+      }
+
+      template <typename Func>
+      static void visit(const Node* node, int pos, const QByteArray& path, Func& func)
+      {
+        for (QHash<QByteArray, Node*>::const_iterator it = node->children.constBegin(); it != node->children.constEnd(); ++it)
+        {
+          if (pos == 0 && it.key().startsWith('$'))
+          {
+            continue;
+          }
+          const QByteArray childPath(join(path, pos, it.key()));
+          if (it.value()->present)
+          {
+            func(childPath);
+          }
+          visit(it.value(), 1, childPath, func);
+        }
+      }
+
+      Node mRoot;
+      Q_DISABLE_COPY(TopicIndex)
+  };
+
+  /// Bounded cache of the last message on each topic, shared by the owner and network threads.
+  class LastValueCache
+  {
+    public:
+      LastValueCache():mEnabled(0),mMutex(),mMaxBytes(0),mBytes(0),mLru(),mTopics(),mIndex(){}
+
+      void setMaxBytes(qint64 maxBytes)
+      {
+        QMutexLocker lock(&mMutex);
+        mMaxBytes = qMax<qint64>(0, maxBytes);
+        mEnabled.store(mMaxBytes > 0 ? 1 : 0);
+        evict();
+      }
+
+      qint64 maxBytes() const
+      {
+        QMutexLocker lock(&mMutex);
+        return mMaxBytes;
+      }
+
+      void update(const QtMosquittoMessage& message)
+      {
+        if (!mEnabled.load())
+        {
+          return;
+        }
+        QMutexLocker lock(&mMutex);
+        // A retained message with an empty payload clears the retained value
+        const bool clear = message.retain() && message.payload().isEmpty();
+        const Topics::iterator found = mTopics.find(message.topic());
+        if (found != mTopics.end())
+        {
+          if (clear)
+          {
+            erase(found);
+            return;
+          }
+          mBytes += cost(message) - cost(*found.value());
+          *found.value() = message;
+          mLru.splice(mLru.begin(), mLru, found.value());
+        }
+        else if (!clear)
+        {
+          mLru.push_front(message);
+          mTopics.insert(message.topic(), mLru.begin());
+          mIndex.insert(message.topic());
+          mBytes += cost(message);
+        }
+        evict();
+      }
+
+      QtMosquittoMessage value(const QByteArray& topic) const
+      {
+        QMutexLocker lock(&mMutex);
+        const Topics::const_iterator found = mTopics.constFind(topic);
+        return (found != mTopics.constEnd()) ? *found.value() : QtMosquittoMessage();
+      }
+
+      QVector<QtMosquittoMessage> values(const QByteArray& filter) const
+      {
+        QMutexLocker lock(&mMutex);
+        QVector<QtMosquittoMessage> result;
+        const Topics& topics = mTopics;
+        mIndex.match(filter, [&result, &topics](const QByteArray& topic)
+        {
+          result.append(*topics.value(topic));
+        });
+        return result;
+      }
+
+    private:
+      typedef std::list<QtMosquittoMessage> List;
+      typedef QHash<QByteArray, List::iterator> Topics;
+
+      static qint64 cost(const QtMosquittoMessage& message)
+      {
+        // Approximate bookkeeping overhead of the list, hash and index entries
+        return message.topic().size() + message.payload().size() + 128;
+      }
+
+      void erase(Topics::iterator found)
+      {
+        mBytes -= cost(*found.value());
+        mIndex.remove(found.key());
+        mLru.erase(found.value());
+        mTopics.erase(found);
+      }
+
+      void evict()
+      {
+        while (!mLru.empty() && mBytes > mMaxBytes)
+        {
+          erase(mTopics.find(mLru.back().topic()));
+        }
+      }
+
+      QAtomicInt mEnabled;
+      mutable QMutex mMutex;
+      qint64 mMaxBytes;
+      qint64 mBytes;
+      List mLru;
+      Topics mTopics;
+      TopicIndex mIndex;
+  };
+}
+
+namespace
+{
+  /// Lock-free counters behind QtMosquittoMetrics.
+  struct Metrics
+  {
+    QAtomicInt enabled;
+    QElapsedTimer clock;
+    QAtomicInteger<quint64> messagesIn;
+    QAtomicInteger<quint64> bytesIn;
+    QAtomicInteger<quint64> messagesOut;
+    QAtomicInteger<quint64> bytesOut;
+    QAtomicInteger<quint64> publishFailures;
+    QAtomicInteger<quint64> reconnects;
+    QAtomicInteger<quint64> disconnects;
+    QAtomicInteger<quint64> conflationDropped;
+    QAtomicInteger<quint64> conflationMerged;
+    QAtomicInteger<quint64> queueDropped;
+    QAtomicInteger<quint64> decodeRejected;
+    QAtomicInteger<quint64> incomingDropped;
+    QAtomicInteger<quint64> laneDropped;
+    QAtomicInteger<quint64> loopTime[QtMosquittoMetrics::HistogramBuckets];
+    QAtomicInteger<quint64> deliveryLatency[QtMosquittoMetrics::HistogramBuckets];
+
+    Metrics() { clock.start(); }
+
+    /// Start time for a sample, or -1 when disabled.
+    qint64 start() const
+    {
+      return enabled.load() ? clock.nsecsElapsed() : -1;
+    }
+
+    void sample(QAtomicInteger<quint64>* histogram, qint64 start)
+    {
+      if (start < 0)
+      {
+        return;
+      }
+      quint64 us = static_cast<quint64>(clock.nsecsElapsed() - start) / 1000;
+      int bucket = 0;
+      while (us != 0 && bucket < QtMosquittoMetrics::HistogramBuckets - 1)
+      {
+        us >>= 1;
+        ++bucket;
+      }
+      histogram[bucket].fetchAndAddRelaxed(1);
+    }
+
+    void count(QAtomicInteger<quint64>& counter, quint64 value = 1)
+    {
+      if (enabled.load())
+      {
+        counter.fetchAndAddRelaxed(value);
+      }
+    }
+  };
+
+  /** Bounded queue of messages with many producers and a single consumer.
+   * Each cell carries a sequence number telling producers and the consumer
+   * whose turn it is, so a push only contends on one atomic increment and the
+   * pop side never writes to shared counters.
+   */
+  class PublishQueue
+  {
+    public:
+      struct Entry
+      {
+        QByteArray topic;
+        QByteArray payload;
+        int qos;
+        bool retain;
+
+        Entry():topic(),payload(),qos(0),retain(false){}
+      };
+
+      PublishQueue(quint32 size, QtMosquittoClient::QueueFullPolicy policy) :
+        mCells(new Cell[size]),
+        mMask(size - 1),
+        mEnqueuePos(0),
+        mDequeuePos(0),
+        mPolicy(policy),
+        mDrainPosted(0),
+        mWaiters(0),
+        mMutex(),
+        mRoom()
+      {
+        for (quint32 i = 0; i < size; ++i)
+        {
+          mCells[i].sequence.store(i);
+        }
+      }
+
+      ~PublishQueue()
+      {
+        delete[] mCells;
+      }
+
+      quint32 capacity() const { return mMask + 1; }
+      QtMosquittoClient::QueueFullPolicy policy() const { return mPolicy; }
+
+      /// Add an entry from any thread, false if the queue is full.
+      bool push(const QByteArray& topic, const QByteArray& payload, int qos, bool retain)
+      {
+        quint32 pos = mEnqueuePos.load();
+        Cell* cell;
+        for (;;)
+        {
+          cell = &mCells[pos & mMask];
+          const qint32 diff = static_cast<qint32>(cell->sequence.loadAcquire() - pos);
+          if (diff == 0)
+          {
+            if (mEnqueuePos.testAndSetRelaxed(pos, pos + 1, pos))
+            {
+              break;
+            }
+          }
+          else if (diff < 0)
+          {
+            return false;
+          }
+          else
+          {
+            pos = mEnqueuePos.load();
+          }
+        }
+        cell->entry.topic = topic;
+        cell->entry.payload = payload;
+        cell->entry.qos = qos;
+        cell->entry.retain = retain;
+        cell->sequence.storeRelease(pos + 1);
+        return true;
+      }
+
+      /// Take the oldest entry, only from the consumer thread.
+      bool pop(Entry& entry)
+      {
+        Cell& cell = mCells[mDequeuePos & mMask];
+        if (static_cast<qint32>(cell.sequence.loadAcquire() - (mDequeuePos + 1)) < 0)
+        {
+          return false;
+        }
+        // Swap so the cell does not keep the payload alive until it is reused
+        qSwap(entry, cell.entry);
+        cell.entry = Entry();
+        cell.sequence.storeRelease(mDequeuePos + mMask + 1);
+        ++mDequeuePos;
+        return true;
+      }
+
+      /// True for the one caller that has to post a drain event.
+      bool claimDrain()
+      {
+        return mDrainPosted.testAndSetOrdered(0, 1);
+      }
+
+      /// Called by the consumer before it starts taking entries.
+      void drainStarted()
+      {
+        mDrainPosted.storeRelease(0);
+      }
+
+      /// Block a producer until the consumer made room or a short timeout.
+      void waitForRoom()
+      {
+        QMutexLocker lock(&mMutex);
+        mWaiters.ref();
+        const quint32 pos = mEnqueuePos.load();
+        if (static_cast<qint32>(mCells[pos & mMask].sequence.loadAcquire() - pos) < 0)
+        {
+          mRoom.wait(&mMutex, 10);
+        }
+        mWaiters.deref();
+      }
+
+      /// Wake producers blocked in waitForRoom().
+      void wakeWaiters()
+      {
+        if (mWaiters.load() > 0)
+        {
+          QMutexLocker lock(&mMutex);
+          mRoom.wakeAll();
+        }
+      }
+
+    private:
+      struct Cell
+      {
+        QAtomicInteger<quint32> sequence;
+        Entry entry;
+      };
+
+      Cell* mCells;
+      const quint32 mMask;
+      QAtomicInteger<quint32> mEnqueuePos;
+      quint32 mDequeuePos;
+      const QtMosquittoClient::QueueFullPolicy mPolicy;
+      QAtomicInt mDrainPosted;
+      QAtomicInt mWaiters;
+      QMutex mMutex;
+      QWaitCondition mRoom;
+      Q_DISABLE_COPY(PublishQueue)
+  };
+
+  /// Token bucket allowing a number of events per second, with bursts of up to one second's worth.
+  class RateLimiter
+  {
+    public:
+      RateLimiter():mRate(0),mTokens(0),mRefilled(0){}
+
+      /// Set the events allowed per second, 0 for no limit, the bucket starts full.
+      void setRate(int rate, qint64 now)
+      {
+        mRate = qMax(0, rate);
+        mTokens = mRate;
+        mRefilled = now;
+      }
+
+      int rate() const { return mRate; }
+
+      /// Take a token, false if none is left.
+      bool take(qint64 now)
+      {
+        if (mRate == 0)
+        {
+          return true;
+        }
+        mTokens = qMin<double>(mRate, mTokens + (now - mRefilled) * mRate / 1000.0);
+        mRefilled = now;
+        if (mTokens < 1.0)
+        {
+          return false;
+        }
+        mTokens -= 1.0;
+        return true;
+      }
+
+      /// Time in milliseconds the next token is available at.
+      qint64 nextToken(qint64 now) const
+      {
+        return now + static_cast<qint64>(std::ceil((1.0 - mTokens) * 1000.0 / mRate));
+      }
+
+    private:
+      int mRate;
+      double mTokens;
+      qint64 mRefilled;
+  };
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 struct QtMosquittoClient::data
 {
   struct mosquitto*  mosq;
   bool autoreconnect;
   bool connected;
+  bool established;
   QTimer processTimer;
+  IoMode ioMode;
+  int keepalive;
+  QSocketNotifier* readNotifier;
+  QSocketNotifier* writeNotifier;
+  QTimer miscTimer;
+  bool threadRunning;
+  TopicCache topicCache;
+  LastValueCache lastValues;
+
+  struct Handler
+  {
+    QByteArray filter;
+    QObject* context;
+    MessageHandler func;
+  };
+  QHash<int, Handler> handlers;
+  QHash<QByteArray, int> handlerFilters;
+  TopicTrie<int> router;
+  int nextHandlerId;
+  int batchMax;
+  int batchDelay;
+  QVector<QtMosquittoMessage> batch;
+  QTimer batchTimer;
+  QMutex incomingMutex;
+  QVector<QtMosquittoMessage> incoming;
+  QVector<qint64> incomingTimes;
+  bool incomingQueued;
+  int incomingMax;
+  int incomingDropped;
+
+  struct ConflationSlot
+  {
+    QtMosquittoMessage message;
+    qint64 due;
+    int interval;
+    int merged;
+    bool pending;
+  };
+  QHash<QByteArray, int> conflationIntervals;
+  TopicTrie<QByteArray> conflationFilters;
+  QHash<QByteArray, ConflationSlot> conflationSlots;
+  // Topics holding a message or delivered less than an interval ago, idle slots are removed once due
+  QSet<QByteArray> conflationActive;
+  RateLimiter conflationRate;
+  QElapsedTimer conflationClock;
+  QTimer conflationTimer;
+  qint64 conflationTimerDue;
+  QSet<int> inflight;
+  int inflightHigh;
+  int inflightLow;
+  bool backpressure;
+  bool rejectOnBackpressure;
+  bool publishing;
+  int publishedDuringPublish;
+  QHash<int, QFutureInterface<int> > pendingPublishes;
+  // Future of the publishAsync() call in progress, taken by a lane or the spool holding the message
+  QFutureInterface<int>* heldFuture;
+  // Futures of spooled messages by spool position, positions count every
+  // message appended to and removed from the spool since setSpool()
+  QMap<quint64, QFutureInterface<int> > spoolFutures;
+  quint64 spoolIn;
+  quint64 spoolOut;
+  QHash<int, QFutureInterface<int> > pendingSubscribes;
+  QHash<int, QFutureInterface<void> > pendingUnsubscribes;
+  Metrics metrics;
+  QTimer metricsTimer;
+  QtMosquittoSpool* spool;
+  int drainRate;
+  QTimer drainTimer;
+  QtMosquittoReconnectPolicy reconnectPolicy;
+  QTimer reconnectTimer;
+  int reconnectAttempt;
+  bool restorePending;
+  std::minstd_rand random;
+  QHash<QByteArray, int> subscriptions;
+  // Filters subscribed with subscribe() rather than for a handler, the
+  // server subscription is kept while either still uses a filter
+  QSet<QByteArray> directSubscriptions;
+  // Read by log_cb_s in the network thread
+  QAtomicInt logLevel;
+  QAtomicInt logSignal;
+  QHash<QByteArray, QtMosquittoCodec*> encoders;
+  TopicTrie<QByteArray> encoderFilters;
+  QByteArray encodeBuffer;
+  // Codecs by ID, looked up by message_cb_s in the network thread
+  QMutex codecMutex;
+  QtMosquittoCodec* codecs[256];
+  QAtomicInt decoding;
+  // Read by decodePayload in the network thread
+  QAtomicInt maxDecodedSize;
+  QAtomicInt maxDecodeRatio;
+  ProtocolVersion protocolVersion;
+  int receiveMaximum;
+  QtMosquittoProperties publishProperties;
+  bool topicAliases;
+  // Set from the CONNACK by connect_v5_cb_s, possibly in the network thread
+  QAtomicInt serverAliasMax;
+  int aliasMax;
+  QHash<QByteArray, int> aliases;
+  // Created once before producer threads start, then only read
+  PublishQueue* publishQueue;
+  int maxInflight;
+  struct LaneMessage
+  {
+    QByteArray topic;
+    QByteArray payload;
+    // Set for messages published with publishAsync()
+    QFutureInterface<int> future;
+    bool async;
+    int qos;
+    bool retain;
+  };
+  QVector<QQueue<LaneMessage> > lanes;
+  QVector<int> laneWeights;
+  QVector<int> laneCredits;
+  int laneQueued;
+  int laneCapacity;
+  QtMosquittoClient::LaneFullPolicy laneFullPolicy;
+  QHash<QByteArray, int> laneRules;
+  TopicTrie<QByteArray> laneFilters;
+  // Only used in the owner thread, received messages are recorded once delivered
+  QtMosquittoRecorder* recorder;
 
-  data():mosq(0),autoreconnect(false),connected(false),processTimer(){}
+  data():mosq(0),autoreconnect(false),connected(false),established(false),processTimer(),
+    ioMode(PollingIo),keepalive(60),readNotifier(0),writeNotifier(0),miscTimer(),
+    threadRunning(false),topicCache(),lastValues(),handlers(),handlerFilters(),router(),nextHandlerId(0),
+    batchMax(0),batchDelay(10),batch(),batchTimer(),incomingMutex(),incoming(),incomingTimes(),incomingQueued(false),incomingMax(0),incomingDropped(0),
+    conflationIntervals(),conflationFilters(),conflationSlots(),conflationActive(),conflationRate(),conflationClock(),conflationTimer(),conflationTimerDue(0),
+    inflight(),inflightHigh(0),inflightLow(0),backpressure(false),rejectOnBackpressure(false),
+    publishing(false),publishedDuringPublish(0),pendingPublishes(),heldFuture(0),spoolFutures(),spoolIn(0),spoolOut(0),pendingSubscribes(),pendingUnsubscribes(),
+    metrics(),metricsTimer(),spool(0),drainRate(100),drainTimer(),
+    reconnectPolicy(),reconnectTimer(),reconnectAttempt(0),restorePending(false),
+    // Seeded per client, devices started from the same image must not share delays
+    random(std::random_device()() ^ static_cast<unsigned>(QDateTime::currentMSecsSinceEpoch()) ^ static_cast<unsigned>(quintptr(this))),
+    subscriptions(),directSubscriptions(),logLevel(LogNone),logSignal(0),
+    encoders(),encoderFilters(),encodeBuffer(),codecMutex(),codecs(),decoding(0),
+    maxDecodedSize(16 * 1024 * 1024),maxDecodeRatio(1024),
+    protocolVersion(Mqtt311),receiveMaximum(0),publishProperties(),topicAliases(true),
+    serverAliasMax(0),aliasMax(0),aliases(),publishQueue(0),
+    maxInflight(20),lanes(),laneWeights(),laneCredits(),laneQueued(0),laneCapacity(10000),laneFullPolicy(LaneRefuse),laneRules(),laneFilters(),recorder(0){}
 };
 
 
@@ -46,6 +1079,12 @@ QtMosquittoClient::QtMosquittoClient(const QString& id, bool clean_session, QObj
   QObject(par),
   d(new data())
 {
+  qRegisterMetaType<QtMosquittoMessage>("QtMosquittoMessage");
+  qRegisterMetaType<QVector<QtMosquittoMessage> >("QVector<QtMosquittoMessage>");
+  qRegisterMetaType<QVector<int> >("QVector<int>");
+  qRegisterMetaType<QtMosquittoMetrics>("QtMosquittoMetrics");
+  qRegisterMetaType<QtMosquittoClient::LogLevel>("QtMosquittoClient::LogLevel");
+
   QByteArray idBA(id.toUtf8());
   const char* idCC = (idBA.size() != 0) ? idBA.data() : 0;
   d->mosq = mosquitto_new(idCC, clean_session, this);
@@ -57,10 +1096,39 @@ QtMosquittoClient::QtMosquittoClient(const QString& id, bool clean_session, QObj
   connect(&d->processTimer, SIGNAL(timeout()), this, SLOT(process()));
   d->processTimer.start();
 
+  d->miscTimer.setTimerType(Qt::CoarseTimer);
+  d->miscTimer.setSingleShot(false);
+  connect(&d->miscTimer, SIGNAL(timeout()), this, SLOT(socketMisc()));
+
+  d->metricsTimer.setSingleShot(false);
+  connect(&d->metricsTimer, SIGNAL(timeout()), this, SLOT(emitMetrics()));
+
+  d->drainTimer.setSingleShot(false);
+  connect(&d->drainTimer, SIGNAL(timeout()), this, SLOT(drainSpool()));
+
+  d->reconnectTimer.setSingleShot(true);
+  connect(&d->reconnectTimer, SIGNAL(timeout()), this, SLOT(reconnectTimeout()));
+
+  d->conflationTimer.setTimerType(Qt::PreciseTimer);
+  d->conflationTimer.setSingleShot(true);
+  connect(&d->conflationTimer, SIGNAL(timeout()), this, SLOT(conflationTimeout()));
+  d->conflationClock.start();
+
+  d->batchTimer.setSingleShot(true);
+  connect(&d->batchTimer, SIGNAL(timeout()), this, SLOT(flushBatch()));
+
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+  // Also called for MQTT 3.1.1, the CONNACK properties are then empty
+  mosquitto_connect_v5_callback_set(d->mosq, &QtMosquittoClient::connect_v5_cb_s);
+#else
   mosquitto_connect_callback_set(d->mosq, &QtMosquittoClient::connect_cb_s);
+#endif
   mosquitto_disconnect_callback_set(d->mosq, &QtMosquittoClient::disconnect_cb_s);
-  mosquitto_log_callback_set(d->mosq, &QtMosquittoClient::log_cb_s);
+  updateLogCallback();
   mosquitto_message_callback_set(d->mosq, &QtMosquittoClient::message_cb_s);
+  mosquitto_publish_callback_set(d->mosq, &QtMosquittoClient::publish_cb_s);
+  mosquitto_subscribe_callback_set(d->mosq, &QtMosquittoClient::subscribe_cb_s);
+  mosquitto_unsubscribe_callback_set(d->mosq, &QtMosquittoClient::unsubscribe_cb_s);
 
 }
 
@@ -70,9 +1138,21 @@ QtMosquittoClient::~QtMosquittoClient()
   if (d->connected)
   {
     mosquitto_disconnect(d->mosq);
-    mosquitto_loop(d->mosq, 100, 1);
+    if (!d->threadRunning)
+    {
+      mosquitto_loop(d->mosq, 100, 1);
+    }
+  }
+  else if (d->threadRunning)
+  {
+    // Make sure the network thread does not try to reconnect
+    mosquitto_disconnect(d->mosq);
   }
+  stopIo();
+  stopThread();
+  cancelPending();
   mosquitto_destroy(d->mosq);
+  delete d->publishQueue;
   delete d;
   d = 0;
 }
@@ -136,127 +1216,1646 @@ bool QtMosquittoClient::setMaxInflightMessages(int max_inflight_messages)
       return false;
     }
 
+    d->maxInflight = max_inflight_messages;
+    feedLanes();
     return true;
 }
 
-bool QtMosquittoClient::doConnect(const QString& host, int port, int keepalive)
+bool QtMosquittoClient::setProtocolVersion(ProtocolVersion version)
 {
   if (d->connected)
   {
-    qWarning() << "QtMosquittoClient::doConnect: Already connected";
+    qWarning() << "QtMosquittoClient::setProtocolVersion: Already connected";
     return false;
   }
-
-  QByteArray hostBA(host.toUtf8());
-  int rc = mosquitto_connect(d->mosq, hostBA.data(), port, keepalive);
-  if (!(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_CONN_PENDING))
+#if LIBMOSQUITTO_VERSION_NUMBER < 1006000
+  if (version == Mqtt5)
   {
-    qWarning() << "QtMosquittoClient::doConnect: Failed to connect" << rc;
+    qWarning() << "QtMosquittoClient::setProtocolVersion: MQTT v5 needs libmosquitto 1.6";
     return false;
   }
-  d->connected = true;
+#endif
+  int value = version;
+  const int rc = mosquitto_opts_set(d->mosq, MOSQ_OPT_PROTOCOL_VERSION, &value);
+  if (rc != MOSQ_ERR_SUCCESS)
+  {
+    qWarning() << "QtMosquittoClient::setProtocolVersion: Failed" << rc;
+    return false;
+  }
+  d->protocolVersion = version;
   return true;
 }
 
-bool QtMosquittoClient::doReconnect()
+QtMosquittoClient::ProtocolVersion QtMosquittoClient::protocolVersion() const
+{
+  return d->protocolVersion;
+}
+
+bool QtMosquittoClient::setReceiveMaximum(int receiveMaximum)
 {
   if (d->connected)
   {
-    qWarning() << "QtMosquittoClient::doReconnect: Already connected";
+    qWarning() << "QtMosquittoClient::setReceiveMaximum: Already connected";
     return false;
   }
-
-  int rc = mosquitto_reconnect(d->mosq);
-  if (!(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_CONN_PENDING))
+  if (receiveMaximum < 0 || receiveMaximum > 65535)
   {
-    qWarning() << "QtMosquittoClient::doReconnect: Failed to reconnect" << rc;
+    qWarning() << "QtMosquittoClient::setReceiveMaximum: Invalid value" << receiveMaximum;
     return false;
   }
-  d->connected = true;
+  d->receiveMaximum = receiveMaximum;
   return true;
 }
 
-bool QtMosquittoClient::doDisconnect()
+void QtMosquittoClient::setTopicAliasesEnabled(bool enabled)
 {
-  if (!d->connected)
+  d->topicAliases = enabled;
+}
+
+int QtMosquittoClient::topicAliasMaximum() const
+{
+  return d->aliasMax;
+}
+
+void QtMosquittoClient::setPublishProperties(const QtMosquittoProperties& properties)
+{
+  d->publishProperties = properties;
+}
+
+QtMosquittoProperties QtMosquittoClient::publishProperties() const
+{
+  return d->publishProperties;
+}
+
+bool QtMosquittoClient::setInflightWatermarks(int high, int low)
+{
+  if (high < 0 || low < 0 || (high > 0 && low >= high))
   {
-    qWarning() << "QtMosquittoClient::doDisconnect: Not connected";
+    qWarning() << "QtMosquittoClient::setInflightWatermarks: Invalid watermarks" << high << low;
     return false;
   }
-  int rc = mosquitto_disconnect(d->mosq);
-  if (rc != MOSQ_ERR_SUCCESS)
+  d->inflightHigh = high;
+  d->inflightLow = low;
+  if (d->backpressure && (high == 0 || d->inflight.size() <= low))
   {
-    qWarning() << "QtMosquittoClient::doDisconnect: Disconnect failed";
-    return false;
+    d->backpressure = false;
+    emit backpressure(false);
+    startDrain();
   }
-  d->connected = false;
-  emit disconnected();
-  emit connectState(false);
   return true;
 }
 
-void QtMosquittoClient::setAutoReconnect(bool reconnect)
+void QtMosquittoClient::setRejectOnBackpressure(bool reject)
 {
-  d->autoreconnect = reconnect;
+  d->rejectOnBackpressure = reject;
 }
 
-
-int QtMosquittoClient::publish(const QString& topic, const QString& payload, int qos, bool retain)
+int QtMosquittoClient::inflightMessages() const
 {
-  return publish(topic, payload.toUtf8(), qos, retain);
+  return d->inflight.size();
 }
 
-int QtMosquittoClient::publish(const QString& topic, const QByteArray& payload, int qos, bool retain)
+bool QtMosquittoClient::setPriorityLanes(const QVector<int>& weights)
 {
-  const QByteArray topicBA(topic.toUtf8());
-  int mid = -1;
-  int rc = mosquitto_publish(d->mosq, &mid, topicBA.data(), payload.size(), payload.data(), qos, retain);
-  if (rc == MOSQ_ERR_SUCCESS)
+  if (d->laneQueued > 0)
   {
-    return mid;
+    qWarning() << "QtMosquittoClient::setPriorityLanes: Messages still queued" << d->laneQueued;
+    return false;
   }
-  else
+  for (int i = 0; i < weights.size(); ++i)
   {
-    qWarning() << "QtMosquittoClient::publish: Failed to publish:" << rc;
-    return -1;
+    if (weights.at(i) < 1)
+    {
+      qWarning() << "QtMosquittoClient::setPriorityLanes: Invalid weight" << weights.at(i);
+      return false;
+    }
   }
+  d->lanes.clear();
+  d->lanes.resize(weights.size());
+  d->laneWeights = weights;
+  d->laneCredits = weights;
+  return true;
 }
 
+void QtMosquittoClient::setLaneCapacity(int capacity, LaneFullPolicy policy)
+{
+  d->laneCapacity = qMax(0, capacity);
+  d->laneFullPolicy = policy;
+}
 
-bool QtMosquittoClient::subscribe(const QString& topic, int qos)
+bool QtMosquittoClient::setPriorityRule(const QString& filter, int lane)
 {
-  const QByteArray topicBA(topic.toUtf8());
-  int rc = mosquitto_subscribe(d->mosq, NULL, topicBA.data(), qos);
-  if (rc == MOSQ_ERR_SUCCESS)
+  const QByteArray filterBA(filter.toUtf8());
+  if (mosquitto_sub_topic_check(filterBA.data()) != MOSQ_ERR_SUCCESS)
   {
-    return true;
+    qWarning() << "QtMosquittoClient::setPriorityRule: Invalid topic filter:" << filter;
+    return false;
   }
-  else
+  if (d->laneRules.remove(filterBA) > 0)
   {
-    qWarning() << "QtMosquittoClient::subscribe: Failed to subscribe:" << topic << rc;
-    return false;
+    d->laneFilters.remove(filterBA, filterBA);
+  }
+  if (lane >= 0)
+  {
+    d->laneRules.insert(filterBA, lane);
+    d->laneFilters.insert(filterBA, filterBA);
   }
+  return true;
 }
 
-bool QtMosquittoClient::unsubscribe(const QString& topic)
+QVector<int> QtMosquittoClient::laneDepths() const
 {
-  const QByteArray topicBA(topic.toUtf8());
-  int rc = mosquitto_unsubscribe(d->mosq, NULL, topicBA.data());
-  if (rc == MOSQ_ERR_SUCCESS)
+  QVector<int> depths(d->lanes.size());
+  for (int i = 0; i < d->lanes.size(); ++i)
   {
-    return true;
+    depths[i] = d->lanes.at(i).size();
   }
-  else
-  {
+  return depths;
+}
+
+void QtMosquittoClient::setSpool(QtMosquittoSpool* spool, int drainRate, int drainInterval)
+{
+  if (spool != d->spool)
+  {
+    // Messages in the previous spool are no longer sent by this client
+    QList<QFutureInterface<int> > futures(d->spoolFutures.values());
+    d->spoolFutures.clear();
+    for (int i = 0; i < futures.size(); ++i)
+    {
+      futures[i].reportCanceled();
+      futures[i].reportFinished();
+    }
+    d->spoolOut = 0;
+    d->spoolIn = (spool && spool->isOpen()) ? static_cast<quint64>(spool->count()) : 0;
+  }
+  d->spool = spool;
+  d->drainRate = qMax(1, drainRate);
+  d->drainTimer.setInterval(qMax(0, drainInterval));
+  d->drainTimer.stop();
+  startDrain();
+}
+
+QtMosquittoSpool* QtMosquittoClient::spool() const
+{
+  return d->spool;
+}
+
+void QtMosquittoClient::setRecorder(QtMosquittoRecorder* recorder)
+{
+  d->recorder = recorder;
+}
+
+QtMosquittoRecorder* QtMosquittoClient::recorder() const
+{
+  return d->recorder;
+}
+
+void QtMosquittoClient::registerCodec(QtMosquittoCodec* codec)
+{
+  if (!codec)
+  {
+    return;
+  }
+  QMutexLocker lock(&d->codecMutex);
+  d->codecs[codec->id()] = codec;
+  d->decoding.store(1);
+}
+
+bool QtMosquittoClient::setPublishCodec(const QString& filter, QtMosquittoCodec* codec)
+{
+  const QByteArray filterBA(filter.toUtf8());
+  if (mosquitto_sub_topic_check(filterBA.data()) != MOSQ_ERR_SUCCESS)
+  {
+    qWarning() << "QtMosquittoClient::setPublishCodec: Invalid topic filter:" << filter;
+    return false;
+  }
+  if (d->encoders.remove(filterBA) > 0)
+  {
+    d->encoderFilters.remove(filterBA, filterBA);
+  }
+  if (codec)
+  {
+    registerCodec(codec);
+    d->encoders.insert(filterBA, codec);
+    d->encoderFilters.insert(filterBA, filterBA);
+  }
+  return true;
+}
+
+QtMosquittoCodec* QtMosquittoClient::encoderFor(const QByteArray& topic) const
+{
+  QByteArray best;
+  d->encoderFilters.match(topic, [&best](const QByteArray& filter)
+  {
+    if (filter.size() > best.size())
+    {
+      best = filter;
+    }
+  });
+  return d->encoders.value(best, 0);
+}
+
+int QtMosquittoClient::encodePayload(QtMosquittoCodec* codec, const QByteArray& payload)
+{
+  // The buffer only ever grows, so steady state publishing does not allocate
+  const int needed = QtMosquittoCodec::HeaderSize + codec->maxEncodedSize(payload.size());
+  if (d->encodeBuffer.size() < needed)
+  {
+    d->encodeBuffer.resize(needed);
+  }
+  char* out = d->encodeBuffer.data();
+  const int size = codec->encode(payload.constData(), payload.size(), out + QtMosquittoCodec::HeaderSize);
+  if (size < 0)
+  {
+    return -1;
+  }
+  memcpy(out, codecMagic, sizeof(codecMagic));
+  out[3] = static_cast<char>(codec->id());
+  qToLittleEndian<quint32>(payload.size(), reinterpret_cast<uchar*>(out + 4));
+  return QtMosquittoCodec::HeaderSize + size;
+}
+
+bool QtMosquittoClient::decodePayload(const char* data, int size, QByteArray& payload)
+{
+  if (size < QtMosquittoCodec::HeaderSize || memcmp(data, codecMagic, sizeof(codecMagic)) != 0)
+  {
+    return false;
+  }
+  QtMosquittoCodec* codec;
+  {
+    QMutexLocker lock(&d->codecMutex);
+    codec = d->codecs[static_cast<quint8>(data[3])];
+  }
+  const quint32 decodedSize = qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(data + 4));
+  if (!codec)
+  {
+    return false;
+  }
+  const quint64 maxRatio = static_cast<quint64>(d->maxDecodeRatio.load());
+  if (decodedSize > maxPayloadSize || decodedSize > static_cast<quint32>(d->maxDecodedSize.load()) ||
+      (maxRatio != 0 && decodedSize > maxRatio * static_cast<quint64>(size)))
+  {
+    d->metrics.count(d->metrics.decodeRejected);
+    return false;
+  }
+  payload = QByteArray(static_cast<int>(decodedSize), Qt::Uninitialized);
+  if (!codec->decode(data + QtMosquittoCodec::HeaderSize, size - QtMosquittoCodec::HeaderSize,
+                     payload.data(), static_cast<int>(decodedSize)))
+  {
+    qWarning() << "QtMosquittoClient::decodePayload: Failed to decode payload with codec" << codec->id();
+    payload.clear();
+    return false;
+  }
+  return true;
+}
+
+void QtMosquittoClient::setMaxDecodedSize(int maxSize, int maxRatio)
+{
+  if (maxSize < 0 || maxRatio < 0)
+  {
+    qWarning() << "QtMosquittoClient::setMaxDecodedSize: Invalid limits" << maxSize << maxRatio;
+    return;
+  }
+  d->maxDecodedSize.store(maxSize);
+  d->maxDecodeRatio.store(maxRatio);
+}
+
+int QtMosquittoClient::maxDecodedSize() const
+{
+  return d->maxDecodedSize.load();
+}
+
+void QtMosquittoClient::setLogLevel(LogLevel level)
+{
+  d->logLevel.store(level);
+  updateLogCallback();
+}
+
+QtMosquittoClient::LogLevel QtMosquittoClient::logLevel() const
+{
+  return static_cast<LogLevel>(d->logLevel.load());
+}
+
+void QtMosquittoClient::connectNotify(const QMetaMethod& signal)
+{
+  if (d && signal == QMetaMethod::fromSignal(&QtMosquittoClient::logMessage))
+  {
+    updateLogCallback();
+  }
+}
+
+void QtMosquittoClient::disconnectNotify(const QMetaMethod& signal)
+{
+  // An invalid method means everything was disconnected at once
+  if (d && (!signal.isValid() || signal == QMetaMethod::fromSignal(&QtMosquittoClient::logMessage)))
+  {
+    updateLogCallback();
+  }
+}
+
+void QtMosquittoClient::updateLogCallback()
+{
+  static const QMetaMethod logSignal = QMetaMethod::fromSignal(&QtMosquittoClient::logMessage);
+  const bool connectedSignal = isSignalConnected(logSignal);
+  d->logSignal.store(connectedSignal ? 1 : 0);
+  // Without a callback the library does not format log messages at all
+  const bool wanted = connectedSignal || d->logLevel.load() != LogNone;
+  mosquitto_log_callback_set(d->mosq, wanted ? &QtMosquittoClient::log_cb_s : NULL);
+}
+
+void QtMosquittoClient::setReconnectPolicy(const QtMosquittoReconnectPolicy& policy)
+{
+  d->reconnectPolicy = policy;
+}
+
+QtMosquittoReconnectPolicy QtMosquittoClient::reconnectPolicy() const
+{
+  return d->reconnectPolicy;
+}
+
+bool QtMosquittoClient::setIoMode(IoMode mode)
+{
+  if (d->connected)
+  {
+    qWarning() << "QtMosquittoClient::setIoMode: Already connected";
+    return false;
+  }
+
+  d->ioMode = mode;
+  if (mode == PollingIo)
+  {
+    d->processTimer.start();
+  }
+  else
+  {
+    d->processTimer.stop();
+  }
+  return true;
+}
+
+QtMosquittoClient::IoMode QtMosquittoClient::ioMode() const
+{
+  return d->ioMode;
+}
+
+void QtMosquittoClient::setBatchDelivery(int maxBatch, int maxDelay)
+{
+  flushBatch();
+  d->batchMax = qMax(0, maxBatch);
+  d->batchDelay = qMax(0, maxDelay);
+}
+
+void QtMosquittoClient::setIncomingQueueLimit(int maxMessages)
+{
+  QMutexLocker lock(&d->incomingMutex);
+  d->incomingMax = qMax(0, maxMessages);
+}
+
+void QtMosquittoClient::setMetricsEnabled(bool enabled, int interval)
+{
+  d->metrics.enabled.store(enabled ? 1 : 0);
+  if (enabled && interval > 0)
+  {
+    d->metricsTimer.start(interval);
+  }
+  else
+  {
+    d->metricsTimer.stop();
+  }
+}
+
+QtMosquittoMetrics QtMosquittoClient::metrics() const
+{
+  QtMosquittoMetrics m;
+  m.messagesIn = d->metrics.messagesIn.load();
+  m.bytesIn = d->metrics.bytesIn.load();
+  m.messagesOut = d->metrics.messagesOut.load();
+  m.bytesOut = d->metrics.bytesOut.load();
+  m.publishFailures = d->metrics.publishFailures.load();
+  m.reconnects = d->metrics.reconnects.load();
+  m.disconnects = d->metrics.disconnects.load();
+  m.conflationDropped = d->metrics.conflationDropped.load();
+  m.conflationMerged = d->metrics.conflationMerged.load();
+  m.queueDropped = d->metrics.queueDropped.load();
+  m.decodeRejected = d->metrics.decodeRejected.load();
+  m.incomingDropped = d->metrics.incomingDropped.load();
+  m.laneDropped = d->metrics.laneDropped.load();
+  m.laneDepths = laneDepths();
+  for (int i = 0; i < QtMosquittoMetrics::HistogramBuckets; ++i)
+  {
+    m.loopTime[i] = d->metrics.loopTime[i].load();
+    m.deliveryLatency[i] = d->metrics.deliveryLatency[i].load();
+  }
+  return m;
+}
+
+void QtMosquittoClient::resetMetrics()
+{
+  d->metrics.messagesIn.store(0);
+  d->metrics.bytesIn.store(0);
+  d->metrics.messagesOut.store(0);
+  d->metrics.bytesOut.store(0);
+  d->metrics.publishFailures.store(0);
+  d->metrics.reconnects.store(0);
+  d->metrics.disconnects.store(0);
+  d->metrics.conflationDropped.store(0);
+  d->metrics.conflationMerged.store(0);
+  d->metrics.queueDropped.store(0);
+  d->metrics.decodeRejected.store(0);
+  d->metrics.incomingDropped.store(0);
+  d->metrics.laneDropped.store(0);
+  for (int i = 0; i < QtMosquittoMetrics::HistogramBuckets; ++i)
+  {
+    d->metrics.loopTime[i].store(0);
+    d->metrics.deliveryLatency[i].store(0);
+  }
+}
+
+void QtMosquittoClient::emitMetrics()
+{
+  emit metricsUpdated(metrics());
+}
+
+void QtMosquittoClient::setTopicCacheSize(int maxTopics)
+{
+  d->topicCache.setMaxSize(maxTopics);
+}
+
+int QtMosquittoClient::topicCacheSize() const
+{
+  return d->topicCache.maxSize();
+}
+
+int QtMosquittoClient::topicId(const QString& topic)
+{
+  TopicCache::Entry entry;
+  d->topicCache.intern(topic.toUtf8(), entry);
+  return entry.id;
+}
+
+QString QtMosquittoClient::topicForId(int id) const
+{
+  return d->topicCache.find(id);
+}
+
+bool QtMosquittoClient::setConflation(const QString& filter, int interval)
+{
+  const QByteArray filterBA(filter.toUtf8());
+  if (mosquitto_sub_topic_check(filterBA.data()) != MOSQ_ERR_SUCCESS)
+  {
+    qWarning() << "QtMosquittoClient::setConflation: Invalid topic filter:" << filter;
+    return false;
+  }
+  if (d->conflationIntervals.remove(filterBA) > 0)
+  {
+    d->conflationFilters.remove(filterBA, filterBA);
+  }
+  if (interval > 0)
+  {
+    d->conflationIntervals.insert(filterBA, interval);
+    d->conflationFilters.insert(filterBA, filterBA);
+  }
+  // Held messages are delivered and topics matched again with the new filters
+  flushConflation(true);
+  d->conflationSlots.clear();
+  d->conflationActive.clear();
+  return true;
+}
+
+void QtMosquittoClient::setConflationRate(int maxRate)
+{
+  d->conflationRate.setRate(maxRate, d->conflationClock.elapsed());
+  flushConflation(false);
+}
+
+void QtMosquittoClient::setLastValueCacheSize(qint64 maxBytes)
+{
+  d->lastValues.setMaxBytes(maxBytes);
+}
+
+qint64 QtMosquittoClient::lastValueCacheSize() const
+{
+  return d->lastValues.maxBytes();
+}
+
+QtMosquittoMessage QtMosquittoClient::lastValue(const QString& topic) const
+{
+  return d->lastValues.value(topic.toUtf8());
+}
+
+QVector<QtMosquittoMessage> QtMosquittoClient::lastValues(const QString& filter) const
+{
+  return d->lastValues.values(filter.toUtf8());
+}
+
+bool QtMosquittoClient::topicMatches(const QByteArray& filter, const QByteArray& topic)
+{
+  bool result = false;
+  return mosquitto_topic_matches_sub(filter.constData(), topic.constData(), &result) == MOSQ_ERR_SUCCESS && result;
+}
+
+bool QtMosquittoClient::doConnect(const QString& host, int port, int keepalive)
+{
+  if (d->connected)
+  {
+    qWarning() << "QtMosquittoClient::doConnect: Already connected";
+    return false;
+  }
+
+  d->reconnectTimer.stop();
+  d->reconnectAttempt = 0;
+  d->restorePending = false;
+  stopThread();
+  QByteArray hostBA(host.toUtf8());
+  int rc;
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+  if (d->protocolVersion == Mqtt5)
+  {
+    // The library keeps the CONNECT properties for reconnects
+    mosquitto_property* props = NULL;
+    if (d->receiveMaximum > 0)
+    {
+      mosquitto_property_add_int16(&props, MQTT_PROP_RECEIVE_MAXIMUM, static_cast<uint16_t>(d->receiveMaximum));
+    }
+    rc = mosquitto_connect_bind_v5(d->mosq, hostBA.data(), port, keepalive, NULL, props);
+    mosquitto_property_free_all(&props);
+  }
+  else
+#endif
+  {
+    rc = mosquitto_connect(d->mosq, hostBA.data(), port, keepalive);
+  }
+  if (!(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_CONN_PENDING))
+  {
+    qWarning() << "QtMosquittoClient::doConnect: Failed to connect" << rc;
+    return false;
+  }
+  d->connected = true;
+  d->keepalive = keepalive;
+  startIo();
+  return true;
+}
+
+bool QtMosquittoClient::isConnected() const
+{
+  return d->connected;
+}
+
+bool QtMosquittoClient::doReconnect()
+{
+  if (d->connected)
+  {
+    qWarning() << "QtMosquittoClient::doReconnect: Already connected";
+    return false;
+  }
+
+  d->reconnectTimer.stop();
+  stopThread();
+  int rc = mosquitto_reconnect(d->mosq);
+  if (!(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_CONN_PENDING))
+  {
+    qWarning() << "QtMosquittoClient::doReconnect: Failed to reconnect" << rc;
+    return false;
+  }
+  d->metrics.count(d->metrics.reconnects);
+  d->connected = true;
+  d->restorePending = true;
+  startIo();
+  return true;
+}
+
+bool QtMosquittoClient::doDisconnect()
+{
+  d->reconnectTimer.stop();
+  d->reconnectAttempt = 0;
+  if (!d->connected)
+  {
+    qWarning() << "QtMosquittoClient::doDisconnect: Not connected";
+    return false;
+  }
+  int rc = mosquitto_disconnect(d->mosq);
+  if (rc != MOSQ_ERR_SUCCESS)
+  {
+    qWarning() << "QtMosquittoClient::doDisconnect: Disconnect failed";
+    return false;
+  }
+  // The notifiers stay up until the DISCONNECT packet has been flushed and
+  // the library reports the disconnection.
+  updateIo();
+  d->connected = false;
+  d->established = false;
+  d->drainTimer.stop();
+  emit disconnected();
+  emit connectState(false);
+  return true;
+}
+
+void QtMosquittoClient::setAutoReconnect(bool reconnect)
+{
+  d->autoreconnect = reconnect;
+  if (!reconnect)
+  {
+    d->reconnectTimer.stop();
+    d->reconnectAttempt = 0;
+  }
+}
+
+void QtMosquittoClient::scheduleReconnect()
+{
+  const QtMosquittoReconnectPolicy& policy = d->reconnectPolicy;
+  if (policy.maxAttempts > 0 && d->reconnectAttempt >= policy.maxAttempts)
+  {
+    qWarning() << "QtMosquittoClient::scheduleReconnect: Giving up after" << d->reconnectAttempt << "attempts";
+    d->reconnectAttempt = 0;
+    emit error(ReconnectFailed);
+    return;
+  }
+  ++d->reconnectAttempt;
+  const int bound = policy.delayBound(d->reconnectAttempt);
+  const int delay = policy.jitter ? std::uniform_int_distribution<int>(0, bound)(d->random) : bound;
+  d->reconnectTimer.start(delay);
+  emit reconnecting(d->reconnectAttempt, delay);
+}
+
+void QtMosquittoClient::reconnectTimeout()
+{
+  if (d->connected || !d->autoreconnect)
+  {
+    return;
+  }
+  if (!doReconnect())
+  {
+    scheduleReconnect();
+  }
+}
+
+void QtMosquittoClient::restoreSubscriptions()
+{
+  // One SUBSCRIBE per QoS level rather than one per topic
+  QMap<int, QList<QByteArray> > byQos;
+  for (QHash<QByteArray, int>::const_iterator it = d->subscriptions.constBegin(); it != d->subscriptions.constEnd(); ++it)
+  {
+    byQos[it.value()].append(it.key());
+  }
+  for (QMap<int, QList<QByteArray> >::const_iterator it = byQos.constBegin(); it != byQos.constEnd(); ++it)
+  {
+    subscribeMultiple(it.value(), it.key());
+  }
+}
+
+int QtMosquittoClient::subscribeMultiple(const QList<QByteArray>& topics, int qos)
+{
+  int mid = -1;
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+  QVector<char*> sub(topics.size());
+  for (int i = 0; i < topics.size(); ++i)
+  {
+    sub[i] = const_cast<char*>(topics.at(i).constData());
+  }
+  const int rc = mosquitto_subscribe_multiple(d->mosq, &mid, sub.size(), sub.data(), qos, 0, NULL);
+#else
+  // Older libraries need a SUBSCRIBE per topic, mid is that of the last one
+  int rc = MOSQ_ERR_SUCCESS;
+  for (int i = 0; i < topics.size() && rc == MOSQ_ERR_SUCCESS; ++i)
+  {
+    rc = mosquitto_subscribe(d->mosq, &mid, topics.at(i).constData(), qos);
+  }
+#endif
+  updateIo();
+  if (rc != MOSQ_ERR_SUCCESS)
+  {
+    qWarning() << "QtMosquittoClient::subscribe: Failed to subscribe:" << topics << rc;
+    return -1;
+  }
+  foreach (const QByteArray& topic, topics)
+  {
+    d->subscriptions.insert(topic, qos);
+  }
+  return mid;
+}
+
+int QtMosquittoClient::subscribe(const QStringList& topics, int qos)
+{
+  if (topics.isEmpty())
+  {
+    qWarning() << "QtMosquittoClient::subscribe: No topics";
+    return -1;
+  }
+  QList<QByteArray> topicsBA;
+  topicsBA.reserve(topics.size());
+  foreach (const QString& topic, topics)
+  {
+    topicsBA.append(topic.toUtf8());
+  }
+  const int mid = subscribeMultiple(topicsBA, qos);
+  if (mid >= 0)
+  {
+    foreach (const QByteArray& topic, topicsBA)
+    {
+      d->directSubscriptions.insert(topic);
+    }
+  }
+  return mid;
+}
+
+int QtMosquittoClient::unsubscribe(const QStringList& topics)
+{
+  if (topics.isEmpty())
+  {
+    qWarning() << "QtMosquittoClient::unsubscribe: No topics";
+    return -1;
+  }
+  QList<QByteArray> topicsBA;
+  topicsBA.reserve(topics.size());
+  foreach (const QString& topic, topics)
+  {
+    const QByteArray topicBA(topic.toUtf8());
+    d->directSubscriptions.remove(topicBA);
+    // Handlers still receive from filters they share with plain subscriptions
+    if (!d->handlerFilters.contains(topicBA))
+    {
+      topicsBA.append(topicBA);
+    }
+  }
+  if (topicsBA.isEmpty())
+  {
+    return 0;
+  }
+
+  int mid = -1;
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+  QVector<char*> sub(topicsBA.size());
+  for (int i = 0; i < topicsBA.size(); ++i)
+  {
+    sub[i] = const_cast<char*>(topicsBA.at(i).constData());
+  }
+  const int rc = mosquitto_unsubscribe_multiple(d->mosq, &mid, sub.size(), sub.data(), NULL);
+#else
+  // Older libraries need an UNSUBSCRIBE per topic, mid is that of the last one
+  int rc = MOSQ_ERR_SUCCESS;
+  for (int i = 0; i < topicsBA.size() && rc == MOSQ_ERR_SUCCESS; ++i)
+  {
+    rc = mosquitto_unsubscribe(d->mosq, &mid, topicsBA.at(i).constData());
+  }
+#endif
+  updateIo();
+  if (rc != MOSQ_ERR_SUCCESS)
+  {
+    qWarning() << "QtMosquittoClient::unsubscribe: Failed to unsubscribe:" << topics << rc;
+    return -1;
+  }
+  foreach (const QByteArray& topic, topicsBA)
+  {
+    d->subscriptions.remove(topic);
+  }
+  return mid;
+}
+
+
+int QtMosquittoClient::publish(const QString& topic, const QString& payload, int qos, bool retain)
+{
+  return publish(topic, payload.toUtf8(), qos, retain);
+}
+
+int QtMosquittoClient::publish(const QString& topic, const QByteArray& payload, int qos, bool retain)
+{
+  return doPublish(topic.toUtf8(), payload, qos, retain);
+}
+
+int QtMosquittoClient::publish(const QtMosquittoTopic& topic, const QByteArray& payload, int qos, bool retain)
+{
+  if (!topic.isValid())
+  {
+    qWarning() << "QtMosquittoClient::publish: Invalid topic:" << topic.utf8();
+    d->metrics.count(d->metrics.publishFailures);
+    return PublishFailed;
+  }
+  return doPublish(topic.utf8(), payload, qos, retain);
+}
+
+int QtMosquittoClient::publish(const QtMosquittoTopic& topic, const QByteArray& payload, int qos, bool retain, const QtMosquittoProperties& properties)
+{
+  if (!topic.isValid())
+  {
+    qWarning() << "QtMosquittoClient::publish: Invalid topic:" << topic.utf8();
+    d->metrics.count(d->metrics.publishFailures);
+    return PublishFailed;
+  }
+  return doPublish(topic.utf8(), payload, qos, retain, &properties);
+}
+
+int QtMosquittoClient::publish(const QtMosquittoTopic& topic, const QByteArray& payload, int qos, bool retain, int priority)
+{
+  if (!topic.isValid())
+  {
+    qWarning() << "QtMosquittoClient::publish: Invalid topic:" << topic.utf8();
+    d->metrics.count(d->metrics.publishFailures);
+    return PublishFailed;
+  }
+  return doPublish(topic.utf8(), payload, qos, retain, 0, qMax(0, priority));
+}
+
+bool QtMosquittoClient::setPublishQueue(int capacity, QueueFullPolicy policy)
+{
+  if (d->publishQueue)
+  {
+    qWarning() << "QtMosquittoClient::setPublishQueue: Queue already created";
+    return false;
+  }
+  if (capacity < 1 || capacity > (1 << 24))
+  {
+    qWarning() << "QtMosquittoClient::setPublishQueue: Invalid capacity" << capacity;
+    return false;
+  }
+  quint32 size = 2;
+  while (size < static_cast<quint32>(capacity))
+  {
+    size <<= 1;
+  }
+  d->publishQueue = new PublishQueue(size, policy);
+  return true;
+}
+
+bool QtMosquittoClient::enqueuePublish(const QtMosquittoTopic& topic, const QByteArray& payload, int qos, bool retain)
+{
+  PublishQueue* queue = d->publishQueue;
+  if (!queue)
+  {
+    qWarning() << "QtMosquittoClient::enqueuePublish: No publish queue";
+    return false;
+  }
+  if (!topic.isValid())
+  {
+    qWarning() << "QtMosquittoClient::enqueuePublish: Invalid topic:" << topic.utf8();
+    d->metrics.count(d->metrics.publishFailures);
+    return false;
+  }
+
+  while (!queue->push(topic.utf8(), payload, qos, retain))
+  {
+    if (queue->policy() == QueueDrop)
+    {
+      d->metrics.count(d->metrics.queueDropped);
+      return false;
+    }
+    if (QThread::currentThread() == thread())
+    {
+      // Waiting here would stop the only thread that can make room
+      drainPublishQueue();
+    }
+    else
+    {
+      if (queue->claimDrain())
+      {
+        QMetaObject::invokeMethod(this, "drainPublishQueue", Qt::QueuedConnection);
+      }
+      queue->waitForRoom();
+    }
+  }
+
+  if (queue->claimDrain())
+  {
+    QMetaObject::invokeMethod(this, "drainPublishQueue", Qt::QueuedConnection);
+  }
+  return true;
+}
+
+QtMosquittoStreamSender* QtMosquittoClient::publishStream(const QtMosquittoTopic& topic, QIODevice* source, int chunkSize, int qos)
+{
+  QtMosquittoStreamSender* sender = new QtMosquittoStreamSender(this, topic, source, chunkSize, qos, 8, this);
+  // Connected first, a short stream can finish inside start()
+  connect(sender, SIGNAL(finished(bool)), sender, SLOT(deleteLater()));
+  if (!sender->start())
+  {
+    delete sender;
+    return 0;
+  }
+  return sender;
+}
+
+void QtMosquittoClient::drainPublishQueue()
+{
+  PublishQueue* queue = d->publishQueue;
+  if (!queue)
+  {
+    return;
+  }
+
+  // Producers pushing from now on post a new event, so none is lost
+  queue->drainStarted();
+
+  // Take at most one queue's worth so busy producers can not starve the event loop
+  const quint32 limit = queue->capacity();
+  quint32 taken = 0;
+  PublishQueue::Entry entry;
+  while (taken < limit && queue->pop(entry))
+  {
+    doPublish(entry.topic, entry.payload, entry.qos, entry.retain);
+    ++taken;
+  }
+  queue->wakeWaiters();
+
+  if (taken == limit && queue->claimDrain())
+  {
+    QMetaObject::invokeMethod(this, "drainPublishQueue", Qt::QueuedConnection);
+  }
+}
+
+int QtMosquittoClient::doPublish(const QByteArray& topic, const QByteArray& payload, int qos, bool retain, const QtMosquittoProperties* properties, int lane)
+{
+  const int result = routePublish(topic, payload, qos, retain, properties, lane);
+  // Only messages the client accepted, sent or held for later, are replayed
+  if (d->recorder && result >= 0)
+  {
+    d->recorder->record(QtMosquittoRecorder::Outbound, topic, payload, qos, retain);
+  }
+  return result;
+}
+
+int QtMosquittoClient::routePublish(const QByteArray& topic, const QByteArray& payload, int qos, bool retain, const QtMosquittoProperties* properties, int lane)
+{
+  const char* body = payload.constData();
+  int bodySize = payload.size();
+  QtMosquittoCodec* codec = d->encoders.isEmpty() ? 0 : encoderFor(topic);
+  if (codec)
+  {
+    bodySize = encodePayload(codec, payload);
+    if (bodySize < 0)
+    {
+      qWarning() << "QtMosquittoClient::publish: Failed to encode payload with codec" << codec->id();
+      d->metrics.count(d->metrics.publishFailures);
+      return PublishFailed;
+    }
+    body = d->encodeBuffer.constData();
+  }
+
+  const bool spooling = qos > 0 && d->spool && d->spool->isOpen();
+  // Once anything is spooled later messages follow it, to keep their order
+  if (spooling && (!d->established || d->backpressure || !d->spool->isEmpty()))
+  {
+    return spoolPublish(topic, QByteArray::fromRawData(body, bodySize), qos, retain);
+  }
+  if (d->backpressure && d->rejectOnBackpressure)
+  {
+    d->metrics.count(d->metrics.publishFailures);
+    return PublishBackpressure;
+  }
+  // Held messages go first, a message must not overtake others in its lane
+  if (qos > 0 && !d->lanes.isEmpty() && d->established && d->maxInflight > 0 &&
+      (d->laneQueued > 0 || d->inflight.size() >= d->maxInflight))
+  {
+    return lanePublish(topic, codec ? QByteArray(body, bodySize) : payload, qos, retain, lane);
+  }
+
+  int mid = -1;
+  const int rc = sendPublish(topic, body, bodySize, qos, retain, mid, properties);
+  if (rc == MOSQ_ERR_SUCCESS)
+  {
+    return mid;
+  }
+  else if (rc == MOSQ_ERR_NO_CONN && spooling)
+  {
+    return spoolPublish(topic, QByteArray::fromRawData(body, bodySize), qos, retain);
+  }
+  else
+  {
+    qWarning() << "QtMosquittoClient::publish: Failed to publish:" << rc;
+    d->metrics.count(d->metrics.publishFailures);
+    return PublishFailed;
+  }
+}
+
+int QtMosquittoClient::sendPublish(const QByteArray& topic, const char* payload, int payloadlen, int qos, bool retain, int& mid, const QtMosquittoProperties* properties)
+{
+  d->publishing = true;
+  int rc;
+  if (d->protocolVersion == Mqtt5)
+  {
+    rc = sendPublishV5(topic, payload, payloadlen, qos, retain, mid, properties ? *properties : d->publishProperties);
+  }
+  else
+  {
+    rc = mosquitto_publish(d->mosq, &mid, topic.constData(), payloadlen, payload, qos, retain);
+  }
+  d->publishing = false;
+  updateIo();
+  if (rc == MOSQ_ERR_SUCCESS)
+  {
+    d->metrics.count(d->metrics.messagesOut);
+    d->metrics.count(d->metrics.bytesOut, payloadlen);
+    if (qos > 0)
+    {
+      d->inflight.insert(mid);
+      if (d->inflightHigh > 0 && !d->backpressure && d->inflight.size() >= d->inflightHigh)
+      {
+        d->backpressure = true;
+        emit backpressure(true);
+      }
+    }
+  }
+  return rc;
+}
+
+int QtMosquittoClient::sendPublishV5(const QByteArray& topic, const char* payload, int payloadlen, int qos, bool retain, int& mid, const QtMosquittoProperties& properties)
+{
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+  mosquitto_property* props = NULL;
+  if (properties.messageExpiry > 0)
+  {
+    mosquitto_property_add_int32(&props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, static_cast<uint32_t>(properties.messageExpiry));
+  }
+  for (int i = 0; i < properties.userProperties.size(); ++i)
+  {
+    const QByteArray name(properties.userProperties.at(i).first.toUtf8());
+    const QByteArray value(properties.userProperties.at(i).second.toUtf8());
+    mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, name.constData(), value.constData());
+  }
+
+  // Aliases are only valid on this network connection, QoS 1 and 2 messages
+  // may be resent after a reconnect so they always carry the full topic.
+  const char* topicName = topic.constData();
+  int newAlias = 0;
+  if (qos == 0 && d->topicAliases && d->established && d->aliasMax > 0)
+  {
+    const QHash<QByteArray, int>::const_iterator found = d->aliases.constFind(topic);
+    if (found != d->aliases.constEnd())
+    {
+      mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, static_cast<uint16_t>(found.value()));
+      topicName = NULL;
+    }
+    else if (d->aliases.size() < d->aliasMax)
+    {
+      // The first message carries both the topic and the alias to set it up
+      newAlias = d->aliases.size() + 1;
+      mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, static_cast<uint16_t>(newAlias));
+    }
+  }
+
+  const int rc = mosquitto_publish_v5(d->mosq, &mid, topicName, payloadlen, payload, qos, retain, props);
+  mosquitto_property_free_all(&props);
+  if (rc == MOSQ_ERR_SUCCESS && newAlias > 0)
+  {
+    d->aliases.insert(topic, newAlias);
+  }
+  return rc;
+#else
+  Q_UNUSED(properties);
+  return mosquitto_publish(d->mosq, &mid, topic.constData(), payloadlen, payload, qos, retain);
+#endif
+}
+
+int QtMosquittoClient::spoolPublish(const QByteArray& topic, const QByteArray& payload, int qos, bool retain)
+{
+  const quint64 dropped = d->spool->dropped();
+  if (!d->spool->append(topic, payload, qos, retain))
+  {
+    qWarning() << "QtMosquittoClient::publish: Spool refused message:" << topic;
+    d->metrics.count(d->metrics.publishFailures);
+    return PublishFailed;
+  }
+  // The oldest messages were discarded to make room
+  for (quint64 n = dropped; n < d->spool->dropped(); ++n)
+  {
+    releaseSpoolFuture(-1);
+  }
+  if (d->heldFuture)
+  {
+    d->spoolFutures.insert(d->spoolIn, *d->heldFuture);
+  }
+  ++d->spoolIn;
+  startDrain();
+  return PublishQueued;
+}
+
+int QtMosquittoClient::lanePublish(const QByteArray& topic, const QByteArray& payload, int qos, bool retain, int lane)
+{
+  if (lane < 0)
+  {
+    QByteArray best;
+    d->laneFilters.match(topic, [&best](const QByteArray& filter)
+    {
+      if (filter.size() > best.size())
+      {
+        best = filter;
+      }
+    });
+    lane = d->laneRules.value(best, d->lanes.size() - 1);
+  }
+  lane = qMin(lane, d->lanes.size() - 1);
+
+  data::LaneMessage msg;
+  msg.topic = topic;
+  msg.payload = payload;
+  msg.qos = qos;
+  msg.retain = retain;
+  msg.async = (d->heldFuture != 0);
+  if (msg.async)
+  {
+    msg.future = *d->heldFuture;
+  }
+  QQueue<data::LaneMessage>& queue = d->lanes[lane];
+  if (d->laneCapacity > 0 && queue.size() >= d->laneCapacity)
+  {
+    d->metrics.count(d->metrics.laneDropped);
+    if (d->laneFullPolicy == LaneRefuse)
+    {
+      d->metrics.count(d->metrics.publishFailures);
+      return PublishBackpressure;
+    }
+    data::LaneMessage dropped(queue.dequeue());
+    --d->laneQueued;
+    if (dropped.async)
+    {
+      dropped.future.reportCanceled();
+      dropped.future.reportFinished();
+    }
+  }
+  queue.enqueue(msg);
+  ++d->laneQueued;
+  return PublishQueued;
+}
+
+int QtMosquittoClient::nextLane()
+{
+  // Weighted round robin, a round ends once no waiting lane has credit left
+  for (int round = 0; round < 2; ++round)
+  {
+    for (int i = 0; i < d->lanes.size(); ++i)
+    {
+      if (!d->lanes.at(i).isEmpty() && d->laneCredits.at(i) > 0)
+      {
+        --d->laneCredits[i];
+        return i;
+      }
+    }
+    d->laneCredits = d->laneWeights;
+  }
+  return -1;
+}
+
+void QtMosquittoClient::feedLanes()
+{
+  while (d->laneQueued > 0 && d->established && !d->publishing &&
+         (d->maxInflight == 0 || d->inflight.size() < d->maxInflight))
+  {
+    const int lane = nextLane();
+    Q_ASSERT(lane >= 0);
+    const data::LaneMessage msg(d->lanes[lane].dequeue());
+    --d->laneQueued;
+    int mid = -1;
+    const int rc = sendPublish(msg.topic, msg.payload.constData(), msg.payload.size(), msg.qos, msg.retain, mid);
+    if (rc == MOSQ_ERR_NO_CONN)
+    {
+      // Keep the message at the front of its lane until connected again
+      d->lanes[lane].prepend(msg);
+      ++d->laneQueued;
+      return;
+    }
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+      qWarning() << "QtMosquittoClient::feedLanes: Dropping message:" << msg.topic << rc;
+      d->metrics.count(d->metrics.publishFailures);
+    }
+    if (msg.async)
+    {
+      QFutureInterface<int> future(msg.future);
+      if (rc == MOSQ_ERR_SUCCESS)
+      {
+        d->pendingPublishes.insert(mid, future);
+      }
+      else
+      {
+        future.reportCanceled();
+        future.reportFinished();
+      }
+    }
+  }
+}
+
+void QtMosquittoClient::startDrain()
+{
+  if (d->spool && d->established && !d->backpressure && !d->drainTimer.isActive() &&
+      d->spool->isOpen() && !d->spool->isEmpty())
+  {
+    d->drainTimer.start();
+  }
+}
+
+void QtMosquittoClient::drainSpool()
+{
+  for (int sent = 0; sent < d->drainRate; ++sent)
+  {
+    if (!d->spool || !d->established || d->backpressure || !d->spool->isOpen() || d->spool->isEmpty())
+    {
+      d->drainTimer.stop();
+      return;
+    }
+    const QtMosquittoMessage msg(d->spool->peek());
+    int mid = -1;
+    const int rc = sendPublish(msg.topic(), msg.payload().constData(), msg.payload().size(), msg.qos(), msg.retain(), mid);
+    if (rc == MOSQ_ERR_NO_CONN)
+    {
+      // Keep the message, the drain restarts once connected again
+      d->drainTimer.stop();
+      return;
+    }
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+      qWarning() << "QtMosquittoClient::drainSpool: Dropping message:" << msg.topic() << rc;
+      d->metrics.count(d->metrics.publishFailures);
+    }
+    d->spool->pop();
+    releaseSpoolFuture(rc == MOSQ_ERR_SUCCESS ? mid : -1);
+  }
+}
+
+void QtMosquittoClient::releaseSpoolFuture(int mid)
+{
+  QMap<quint64, QFutureInterface<int> >::iterator found = d->spoolFutures.find(d->spoolOut++);
+  if (found == d->spoolFutures.end())
+  {
+    return;
+  }
+  QFutureInterface<int> future(found.value());
+  d->spoolFutures.erase(found);
+  if (mid > 0)
+  {
+    // Finishes once the message is acknowledged, like any other publish
+    d->pendingPublishes.insert(mid, future);
+  }
+  else
+  {
+    future.reportCanceled();
+    future.reportFinished();
+  }
+}
+
+
+bool QtMosquittoClient::subscribe(const QString& topic, int qos)
+{
+  const QByteArray topicBA(topic.toUtf8());
+  if (!serverSubscribe(topicBA, qos))
+  {
+    return false;
+  }
+  d->directSubscriptions.insert(topicBA);
+  return true;
+}
+
+bool QtMosquittoClient::unsubscribe(const QString& topic)
+{
+  const QByteArray topicBA(topic.toUtf8());
+  d->directSubscriptions.remove(topicBA);
+  if (d->handlerFilters.contains(topicBA))
+  {
+    // Still used by a handler, which keeps the server subscription
+    return true;
+  }
+  return serverUnsubscribe(topicBA);
+}
+
+bool QtMosquittoClient::serverSubscribe(const QByteArray& topic, int qos)
+{
+  int rc = mosquitto_subscribe(d->mosq, NULL, topic.constData(), qos);
+  updateIo();
+  if (rc == MOSQ_ERR_SUCCESS)
+  {
+    d->subscriptions.insert(topic, qos);
+    return true;
+  }
+  else
+  {
+    qWarning() << "QtMosquittoClient::subscribe: Failed to subscribe:" << topic << rc;
+    return false;
+  }
+}
+
+bool QtMosquittoClient::serverUnsubscribe(const QByteArray& topic)
+{
+  int rc = mosquitto_unsubscribe(d->mosq, NULL, topic.constData());
+  updateIo();
+  if (rc == MOSQ_ERR_SUCCESS)
+  {
+    d->subscriptions.remove(topic);
+    return true;
+  }
+  else
+  {
     qWarning() << "QtMosquittoClient::unsubscribe: Failed to unsubscribe:" << topic << rc;
     return false;
   }
 }
 
 
+QFuture<int> QtMosquittoClient::publishAsync(const QString& topic, const QByteArray& payload, int qos, bool retain)
+{
+  QFutureInterface<int> future;
+  future.reportStarted();
+  d->publishedDuringPublish = 0;
+  d->heldFuture = &future;
+  const int mid = doPublish(topic.toUtf8(), payload, qos, retain);
+  d->heldFuture = 0;
+  if (mid < 0)
+  {
+    future.reportCanceled();
+    future.reportFinished();
+  }
+  else if (mid == PublishQueued)
+  {
+    // Held by a lane or the spool, which hand the future on once the message is sent
+  }
+  else if (d->publishedDuringPublish == mid)
+  {
+    // QoS 0 messages may have been written before mosquitto_publish returned
+    future.reportFinished(&mid);
+  }
+  else
+  {
+    d->pendingPublishes.insert(mid, future);
+  }
+  return future.future();
+}
+
+QFuture<int> QtMosquittoClient::subscribeAsync(const QString& topic, int qos)
+{
+  QFutureInterface<int> future;
+  future.reportStarted();
+  const QByteArray topicBA(topic.toUtf8());
+  int mid = -1;
+  int rc = mosquitto_subscribe(d->mosq, &mid, topicBA.data(), qos);
+  updateIo();
+  if (rc == MOSQ_ERR_SUCCESS)
+  {
+    d->subscriptions.insert(topicBA, qos);
+    d->directSubscriptions.insert(topicBA);
+    d->pendingSubscribes.insert(mid, future);
+  }
+  else
+  {
+    qWarning() << "QtMosquittoClient::subscribeAsync: Failed to subscribe:" << topic << rc;
+    future.reportCanceled();
+    future.reportFinished();
+  }
+  return future.future();
+}
+
+QFuture<void> QtMosquittoClient::unsubscribeAsync(const QString& topic)
+{
+  QFutureInterface<void> future;
+  future.reportStarted();
+  const QByteArray topicBA(topic.toUtf8());
+  d->directSubscriptions.remove(topicBA);
+  if (d->handlerFilters.contains(topicBA))
+  {
+    // Still used by a handler, which keeps the server subscription
+    future.reportFinished();
+    return future.future();
+  }
+  int mid = -1;
+  int rc = mosquitto_unsubscribe(d->mosq, &mid, topicBA.data());
+  updateIo();
+  if (rc == MOSQ_ERR_SUCCESS)
+  {
+    d->subscriptions.remove(topicBA);
+    d->pendingUnsubscribes.insert(mid, future);
+  }
+  else
+  {
+    qWarning() << "QtMosquittoClient::unsubscribeAsync: Failed to unsubscribe:" << topic << rc;
+    future.reportCanceled();
+    future.reportFinished();
+  }
+  return future.future();
+}
+
+void QtMosquittoClient::cancelPending()
+{
+  QList<QFutureInterface<int> > futures(d->pendingPublishes.values() + d->pendingSubscribes.values());
+  QList<QFutureInterface<void> > voidFutures(d->pendingUnsubscribes.values());
+  d->pendingPublishes.clear();
+  d->pendingSubscribes.clear();
+  d->pendingUnsubscribes.clear();
+  for (int i = 0; i < futures.size(); ++i)
+  {
+    futures[i].reportCanceled();
+    futures[i].reportFinished();
+  }
+  for (int i = 0; i < voidFutures.size(); ++i)
+  {
+    voidFutures[i].reportCanceled();
+    voidFutures[i].reportFinished();
+  }
+}
+
+int QtMosquittoClient::subscribe(const QString& filter, int qos, QObject* context, const MessageHandler& handler)
+{
+  const QByteArray filterBA(filter.toUtf8());
+  if (mosquitto_sub_topic_check(filterBA.data()) != MOSQ_ERR_SUCCESS)
+  {
+    qWarning() << "QtMosquittoClient::subscribe: Invalid topic filter:" << filter;
+    return -1;
+  }
+  // The server subscription is shared with other handlers and plain subscriptions of the filter
+  if (!d->handlerFilters.contains(filterBA) && !d->directSubscriptions.contains(filterBA) &&
+      !serverSubscribe(filterBA, qos))
+  {
+    return -1;
+  }
+
+  data::Handler h;
+  h.filter = filterBA;
+  h.context = context;
+  h.func = handler;
+  const int id = ++d->nextHandlerId;
+  d->handlers.insert(id, h);
+  ++d->handlerFilters[filterBA];
+  d->router.insert(filterBA, id);
+  if (context)
+  {
+    connect(context, SIGNAL(destroyed(QObject*)), this, SLOT(handlerContextDestroyed(QObject*)), Qt::UniqueConnection);
+  }
+  return id;
+}
+
+bool QtMosquittoClient::unsubscribe(int handlerId)
+{
+  QHash<int, data::Handler>::iterator found = d->handlers.find(handlerId);
+  if (found == d->handlers.end())
+  {
+    qWarning() << "QtMosquittoClient::unsubscribe: Unknown handler:" << handlerId;
+    return false;
+  }
+  const QByteArray filter(found->filter);
+  d->handlers.erase(found);
+  d->router.remove(filter, handlerId);
+  if (--d->handlerFilters[filter] == 0)
+  {
+    d->handlerFilters.remove(filter);
+    if (!d->directSubscriptions.contains(filter))
+    {
+      serverUnsubscribe(filter);
+    }
+  }
+  return true;
+}
+
+void QtMosquittoClient::handlerContextDestroyed(QObject* context)
+{
+  QList<int> ids;
+  for (QHash<int, data::Handler>::const_iterator it = d->handlers.constBegin(); it != d->handlers.constEnd(); ++it)
+  {
+    if (it->context == context)
+    {
+      ids.append(it.key());
+    }
+  }
+  foreach (int id, ids)
+  {
+    unsubscribe(id);
+  }
+}
+
+void QtMosquittoClient::route(const QtMosquittoMessage& msg)
+{
+  // Collect first, handlers may add or remove subscriptions
+  QVarLengthArray<int, 16> ids;
+  d->router.match(msg.topic(), [&ids](int id) { ids.append(id); });
+  for (int i = 0; i < ids.size(); ++i)
+  {
+    const QHash<int, data::Handler>::const_iterator found = d->handlers.constFind(ids[i]);
+    if (found != d->handlers.constEnd())
+    {
+      const MessageHandler func(found->func);
+      func(msg);
+    }
+  }
+}
+
 void QtMosquittoClient::process()
 {
+  const qint64 start = d->metrics.start();
   mosquitto_loop(d->mosq, 0, 1);
+  d->metrics.sample(d->metrics.loopTime, start);
+}
+
+void QtMosquittoClient::socketRead()
+{
+  const qint64 start = d->metrics.start();
+  // Packets already decrypted into the TLS buffer do not make the socket
+  // readable again, so read until the library reports it would block.
+  // It returns success in that case and leaves errno set.
+  for (int i = 0; i < maxReadsPerNotify; ++i)
+  {
+    errno = 0;
+    if (mosquitto_loop_read(d->mosq, 1) != MOSQ_ERR_SUCCESS || errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      break;
+    }
+  }
+  d->metrics.sample(d->metrics.loopTime, start);
+  updateIo();
+}
+
+void QtMosquittoClient::socketWrite()
+{
+  const qint64 start = d->metrics.start();
+  mosquitto_loop_write(d->mosq, 1);
+  d->metrics.sample(d->metrics.loopTime, start);
+  updateIo();
+}
+
+void QtMosquittoClient::socketMisc()
+{
+  const qint64 start = d->metrics.start();
+  mosquitto_loop_misc(d->mosq);
+  d->metrics.sample(d->metrics.loopTime, start);
+  updateIo();
+}
+
+void QtMosquittoClient::startIo()
+{
+  stopIo();
+  if (d->ioMode == ThreadedIo)
+  {
+    const int rc = mosquitto_loop_start(d->mosq);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+      qWarning() << "QtMosquittoClient::startIo: Failed to start network thread" << rc;
+      return;
+    }
+    d->threadRunning = true;
+    return;
+  }
+  if (d->ioMode != NotifierIo)
+  {
+    return;
+  }
+
+  const int sock = mosquitto_socket(d->mosq);
+  if (sock < 0)
+  {
+    qWarning() << "QtMosquittoClient::startIo: No socket";
+    return;
+  }
+
+  d->readNotifier = new QSocketNotifier(sock, QSocketNotifier::Read, this);
+  connect(d->readNotifier, SIGNAL(activated(int)), this, SLOT(socketRead()));
+  d->writeNotifier = new QSocketNotifier(sock, QSocketNotifier::Write, this);
+  connect(d->writeNotifier, SIGNAL(activated(int)), this, SLOT(socketWrite()));
+
+  // Keepalive pings and ping timeouts are handled by mosquitto_loop_misc,
+  // running it four times per keepalive period keeps the ping within 25% of
+  // the negotiated interval.
+  d->miscTimer.setInterval(qMax(1000, d->keepalive * 250));
+  d->miscTimer.start();
+  updateIo();
+}
+
+void QtMosquittoClient::stopIo()
+{
+  d->miscTimer.stop();
+  // The notifiers may be the sender of the signal currently being handled,
+  // so they can only be deleted once control returns to the event loop.
+  if (d->readNotifier)
+  {
+    d->readNotifier->setEnabled(false);
+    d->readNotifier->deleteLater();
+    d->readNotifier = 0;
+  }
+  if (d->writeNotifier)
+  {
+    d->writeNotifier->setEnabled(false);
+    d->writeNotifier->deleteLater();
+    d->writeNotifier = 0;
+  }
+}
+
+void QtMosquittoClient::stopThread()
+{
+  // The network thread leaves mosquitto_loop_forever once the client is
+  // disconnecting, which is always the case before a new connection is made
+  // or the client is destroyed. It is not joined from disconnect_cb as that
+  // may be delivered after a new connection has already been started.
+  if (d->threadRunning)
+  {
+    mosquitto_loop_stop(d->mosq, false);
+    d->threadRunning = false;
+  }
+}
+
+void QtMosquittoClient::updateIo()
+{
+  if (!d->readNotifier)
+  {
+    return;
+  }
+  if (mosquitto_socket(d->mosq) < 0)
+  {
+    // The library has closed the socket, it will be replaced on reconnect.
+    stopIo();
+    return;
+  }
+  d->writeNotifier->setEnabled(mosquitto_want_write(d->mosq));
 }
 
 
@@ -265,12 +2864,24 @@ void QtMosquittoClient::connect_cb(int rc)
   if (rc == 0)
   {
     d->connected = true;
+    d->established = true;
+    d->reconnectAttempt = 0;
+    d->aliases.clear();
+    d->aliasMax = d->serverAliasMax.load();
+    if (d->restorePending && d->reconnectPolicy.restoreSubscriptions && !d->subscriptions.isEmpty())
+    {
+      restoreSubscriptions();
+    }
+    d->restorePending = false;
     emit connected();
     emit connectState(true);
+    feedLanes();
+    startDrain();
   }
   else
   {
     d->connected = false;
+    d->established = false;
     emit connectState(false);
     switch (rc)
     {
@@ -286,49 +2897,431 @@ void QtMosquittoClient::connect_cb_s(struct mosquitto*, void* obj, int rc)
 {
   QtMosquittoClient* self = static_cast<QtMosquittoClient*>(obj);
   Q_ASSERT(self != 0);
-  self->connect_cb(rc);
+  if (self->d->ioMode == ThreadedIo)
+  {
+    QMetaObject::invokeMethod(self, "connect_cb", Qt::QueuedConnection, Q_ARG(int, rc));
+  }
+  else
+  {
+    self->connect_cb(rc);
+  }
+}
+
+void QtMosquittoClient::connect_v5_cb_s(struct mosquitto* mosq, void* obj, int rc, int, const struct mqtt5__property* props)
+{
+  QtMosquittoClient* self = static_cast<QtMosquittoClient*>(obj);
+  Q_ASSERT(self != 0);
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+  uint16_t aliasMax = 0;
+  mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &aliasMax, false);
+  self->d->serverAliasMax.store(aliasMax);
+#else
+  Q_UNUSED(props);
+#endif
+  connect_cb_s(mosq, self, rc);
 }
 
 void QtMosquittoClient::disconnect_cb(int rc)
 {
+  stopIo();
+  cancelPending();
   d->connected = false;
+  d->established = false;
+  d->aliases.clear();
+  d->aliasMax = 0;
+  d->drainTimer.stop();
   emit disconnected();
   emit connectState(false);
   if (rc != 0)
   {
     qWarning() << "QtMosquittoClient::disconnect_cb rc: " << rc;
+    d->metrics.count(d->metrics.disconnects);
     emit error(UnexpectedDisconnect);
-    if (d->autoreconnect)
+    if (d->autoreconnect && !d->reconnectTimer.isActive())
+    {
+      scheduleReconnect();
+    }
+  }
+}
+
+void QtMosquittoClient::disconnect_cb_s(struct mosquitto* mosq, void* obj, int rc)
+{
+  QtMosquittoClient* self = static_cast<QtMosquittoClient*>(obj);
+  Q_ASSERT(self != 0);
+  if (self->d->ioMode == ThreadedIo)
+  {
+    if (rc != 0)
+    {
+      // Stop mosquitto_loop_forever from reconnecting on its own, whether
+      // to reconnect is decided by disconnect_cb in the owner thread.
+      mosquitto_disconnect(mosq);
+    }
+    QMetaObject::invokeMethod(self, "disconnect_cb", Qt::QueuedConnection, Q_ARG(int, rc));
+  }
+  else
+  {
+    self->disconnect_cb(rc);
+  }
+}
+
+
+void QtMosquittoClient::publish_cb(int mid)
+{
+  if (d->inflight.remove(mid))
+  {
+    // Hand the freed slot to the lanes before the spool gets to fill it
+    feedLanes();
+    if (d->backpressure && d->inflight.size() <= d->inflightLow)
+    {
+      d->backpressure = false;
+      emit backpressure(false);
+      startDrain();
+    }
+  }
+  if (d->publishing)
+  {
+    d->publishedDuringPublish = mid;
+  }
+  QHash<int, QFutureInterface<int> >::iterator future = d->pendingPublishes.find(mid);
+  if (future != d->pendingPublishes.end())
+  {
+    future->reportFinished(&mid);
+    d->pendingPublishes.erase(future);
+  }
+  emit published(mid);
+}
+
+void QtMosquittoClient::publish_cb_s(struct mosquitto*, void* obj, int mid)
+{
+  QtMosquittoClient* self = static_cast<QtMosquittoClient*>(obj);
+  Q_ASSERT(self != 0);
+  if (self->d->ioMode == ThreadedIo)
+  {
+    QMetaObject::invokeMethod(self, "publish_cb", Qt::QueuedConnection, Q_ARG(int, mid));
+  }
+  else
+  {
+    self->publish_cb(mid);
+  }
+}
+
+void QtMosquittoClient::subscribe_cb(int mid, const QVector<int>& grantedQos)
+{
+  QHash<int, QFutureInterface<int> >::iterator future = d->pendingSubscribes.find(mid);
+  if (future != d->pendingSubscribes.end())
+  {
+    // 0x80 is the SUBACK failure return code
+    const int granted = grantedQos.value(0, 0x80);
+    if (granted == 0x80)
+    {
+      future->reportCanceled();
+      future->reportFinished();
+    }
+    else
     {
-      doReconnect();
+      future->reportFinished(&granted);
     }
+    d->pendingSubscribes.erase(future);
   }
+  emit subscribed(mid, grantedQos);
 }
 
-void QtMosquittoClient::disconnect_cb_s(struct mosquitto*, void* obj, int rc)
+void QtMosquittoClient::subscribe_cb_s(struct mosquitto*, void* obj, int mid, int qos_count, const int* granted_qos)
 {
   QtMosquittoClient* self = static_cast<QtMosquittoClient*>(obj);
   Q_ASSERT(self != 0);
-  self->disconnect_cb(rc);
+  QVector<int> grantedQos(qos_count);
+  for (int i = 0; i < qos_count; ++i)
+  {
+    grantedQos[i] = granted_qos[i];
+  }
+  if (self->d->ioMode == ThreadedIo)
+  {
+    QMetaObject::invokeMethod(self, "subscribe_cb", Qt::QueuedConnection, Q_ARG(int, mid), Q_ARG(QVector<int>, grantedQos));
+  }
+  else
+  {
+    self->subscribe_cb(mid, grantedQos);
+  }
+}
+
+void QtMosquittoClient::unsubscribe_cb(int mid)
+{
+  QHash<int, QFutureInterface<void> >::iterator future = d->pendingUnsubscribes.find(mid);
+  if (future != d->pendingUnsubscribes.end())
+  {
+    future->reportFinished();
+    d->pendingUnsubscribes.erase(future);
+  }
+  emit unsubscribed(mid);
 }
 
+void QtMosquittoClient::unsubscribe_cb_s(struct mosquitto*, void* obj, int mid)
+{
+  QtMosquittoClient* self = static_cast<QtMosquittoClient*>(obj);
+  Q_ASSERT(self != 0);
+  if (self->d->ioMode == ThreadedIo)
+  {
+    QMetaObject::invokeMethod(self, "unsubscribe_cb", Qt::QueuedConnection, Q_ARG(int, mid));
+  }
+  else
+  {
+    self->unsubscribe_cb(mid);
+  }
+}
 
-void QtMosquittoClient::log_cb_s(struct mosquitto*,void*, int level, const char* str)
+void QtMosquittoClient::log_cb_s(struct mosquitto*,void* obj, int level, const char* str)
 {
+  QtMosquittoClient* self = static_cast<QtMosquittoClient*>(obj);
+  Q_ASSERT(self != 0);
+  LogLevel logLevel;
   switch (level)
   {
-    case MOSQ_LOG_DEBUG:   qDebug() << "MQTT(D):" << str; break;
-    case MOSQ_LOG_INFO:    qDebug() << "MQTT(I):" << str; break;
-    case MOSQ_LOG_NOTICE:  qDebug() << "MQTT(N):" << str; break;
-    case MOSQ_LOG_WARNING: qWarning() << "MQTT(W):" << str; break;
-    case MOSQ_LOG_ERR:     qWarning() << "MQTT(E):" << str; break;
-    default: qDebug() << "MQTT(U):" << str; break;
+    case MOSQ_LOG_INFO:    logLevel = LogInfo; break;
+    case MOSQ_LOG_NOTICE:  logLevel = LogNotice; break;
+    case MOSQ_LOG_WARNING: logLevel = LogWarning; break;
+    case MOSQ_LOG_ERR:     logLevel = LogError; break;
+    default:               logLevel = LogDebug; break;
+  }
+
+  // The level is checked before anything is formatted, qCDebug and friends
+  // also skip formatting when the category is disabled.
+  if (logLevel >= self->d->logLevel.load())
+  {
+    switch (logLevel)
+    {
+      case LogDebug:   qCDebug(lcMosquitto) << "MQTT(D):" << str; break;
+      case LogInfo:    qCDebug(lcMosquitto) << "MQTT(I):" << str; break;
+      case LogNotice:  qCDebug(lcMosquitto) << "MQTT(N):" << str; break;
+      case LogWarning: qCWarning(lcMosquitto) << "MQTT(W):" << str; break;
+      default:         qCCritical(lcMosquitto) << "MQTT(E):" << str; break;
+    }
+  }
+
+  if (self->d->logSignal.load())
+  {
+    const QString text(QString::fromUtf8(str));
+    if (self->d->ioMode == ThreadedIo)
+    {
+      QMetaObject::invokeMethod(self, "logMessage", Qt::QueuedConnection,
+                                Q_ARG(QtMosquittoClient::LogLevel, logLevel), Q_ARG(QString, text));
+    }
+    else
+    {
+      emit self->logMessage(logLevel, text);
+    }
+  }
+}
+
+void QtMosquittoClient::drainIncoming()
+{
+  QVector<QtMosquittoMessage> incoming;
+  QVector<qint64> incomingTimes;
+  int dropped;
+  {
+    QMutexLocker lock(&d->incomingMutex);
+    incoming.swap(d->incoming);
+    incomingTimes.swap(d->incomingTimes);
+    d->incomingQueued = false;
+    dropped = d->incomingDropped;
+    d->incomingDropped = 0;
+  }
+  if (dropped > 0)
+  {
+    emit messagesDropped(dropped);
+  }
+  for (int i = 0; i < incoming.size(); ++i)
+  {
+    message_cb(incoming.at(i), incomingTimes.at(i));
+  }
+}
+
+void QtMosquittoClient::flushBatch()
+{
+  d->batchTimer.stop();
+  if (d->batch.isEmpty())
+  {
+    return;
+  }
+  QVector<QtMosquittoMessage> batch;
+  batch.swap(d->batch);
+  emit messages(batch);
+}
+
+void QtMosquittoClient::message_cb(const QtMosquittoMessage& msg, qint64 received)
+{
+  if (!d->conflationIntervals.isEmpty() && conflate(msg))
+  {
+    return;
+  }
+  deliver(msg, received);
+}
+
+bool QtMosquittoClient::conflate(const QtMosquittoMessage& msg)
+{
+  QHash<QByteArray, data::ConflationSlot>::iterator slot = d->conflationSlots.find(msg.topic());
+  if (slot == d->conflationSlots.end())
+  {
+    QByteArray best;
+    d->conflationFilters.match(msg.topic(), [&best](const QByteArray& filter)
+    {
+      if (filter.size() > best.size())
+      {
+        best = filter;
+      }
+    });
+    const int interval = d->conflationIntervals.value(best, 0);
+    if (interval <= 0)
+    {
+      return false;
+    }
+    data::ConflationSlot added;
+    added.due = 0;
+    added.interval = interval;
+    added.merged = 0;
+    added.pending = false;
+    slot = d->conflationSlots.insert(msg.topic(), added);
+  }
+
+  const qint64 now = d->conflationClock.elapsed();
+  if (!slot->pending && now >= slot->due && d->conflationRate.take(now))
+  {
+    // Quiet topic, deliver straight away and hold the next message
+    slot->due = now + slot->interval;
+    d->conflationActive.insert(msg.topic());
+    armConflationTimer(slot->due, now);
+    return false;
+  }
+  if (slot->pending)
+  {
+    ++slot->merged;
+    d->metrics.count(d->metrics.conflationDropped);
+  }
+  else
+  {
+    slot->pending = true;
+    d->conflationActive.insert(msg.topic());
+    armConflationTimer(slot->due, now);
+  }
+  slot->message = msg;
+  return true;
+}
+
+void QtMosquittoClient::armConflationTimer(qint64 due, qint64 now)
+{
+  if (!d->conflationTimer.isActive() || due < d->conflationTimerDue)
+  {
+    d->conflationTimerDue = due;
+    d->conflationTimer.start(static_cast<int>(qMax<qint64>(0, due - now)));
+  }
+}
+
+void QtMosquittoClient::conflationTimeout()
+{
+  flushConflation(false);
+}
+
+void QtMosquittoClient::flushConflation(bool all)
+{
+  const qint64 now = d->conflationClock.elapsed();
+  qint64 next = -1;
+  QVector<QPair<qint64, QByteArray> > ready;
+  for (QSet<QByteArray>::iterator it = d->conflationActive.begin(); it != d->conflationActive.end();)
+  {
+    QHash<QByteArray, data::ConflationSlot>::iterator slot = d->conflationSlots.find(*it);
+    if (!all && slot->due > now)
+    {
+      next = (next < 0) ? slot->due : qMin(next, slot->due);
+      ++it;
+    }
+    else if (slot->pending)
+    {
+      ready.append(qMakePair(slot->due, *it));
+      ++it;
+    }
+    else
+    {
+      // Nothing arrived within an interval of the last delivery, forget the topic
+      d->conflationSlots.erase(slot);
+      it = d->conflationActive.erase(it);
+    }
+  }
+
+  // Longest held first, so the global rate can not starve a topic
+  std::sort(ready.begin(), ready.end());
+  QVector<QtMosquittoMessage> due;
+  for (int i = 0; i < ready.size(); ++i)
+  {
+    if (!all && !d->conflationRate.take(now))
+    {
+      const qint64 token = d->conflationRate.nextToken(now);
+      next = (next < 0) ? token : qMin(next, token);
+      break;
+    }
+    data::ConflationSlot& slot = d->conflationSlots[ready.at(i).second];
+    if (slot.merged > 0)
+    {
+      d->metrics.count(d->metrics.conflationMerged);
+    }
+    due.append(slot.message);
+    slot.message = QtMosquittoMessage();
+    slot.due = now + slot.interval;
+    slot.merged = 0;
+    slot.pending = false;
+    next = (next < 0) ? slot.due : qMin(next, slot.due);
+  }
+  if (next >= 0)
+  {
+    d->conflationTimerDue = next;
+    d->conflationTimer.start(static_cast<int>(qMax<qint64>(0, next - now)));
+  }
+  else
+  {
+    d->conflationTimer.stop();
+  }
+
+  // Delivered last, handlers may change the conflation filters
+  for (int i = 0; i < due.size(); ++i)
+  {
+    deliver(due.at(i), -1);
   }
 }
 
-void QtMosquittoClient::message_cb(const QString& topic, const QByteArray& payload)
+void QtMosquittoClient::deliver(const QtMosquittoMessage& msg, qint64 received)
 {
-  emit message(topic, payload);
+  // Recorded here, after the queue limit and conflation, so a recording
+  // holds exactly the traffic the application saw
+  if (d->recorder)
+  {
+    d->recorder->record(QtMosquittoRecorder::Inbound, msg.topic(), msg.payload(), msg.qos(), msg.retain());
+  }
+  if (!d->handlers.isEmpty())
+  {
+    route(msg);
+  }
+  emit messageReceived(msg);
+  // Only pay for the UTF-16 conversion when someone uses the legacy signal
+  static const QMetaMethod messageSignal = QMetaMethod::fromSignal(&QtMosquittoClient::message);
+  if (isSignalConnected(messageSignal))
+  {
+    emit message(msg.topicString(), msg.payload());
+  }
+  d->metrics.sample(d->metrics.deliveryLatency, received);
+
+  if (d->batchMax > 0)
+  {
+    if (d->batch.isEmpty())
+    {
+      // The timer bounds the delay even when no further message arrives
+      d->batch.reserve(d->batchMax);
+      d->batchTimer.start(d->batchDelay);
+    }
+    d->batch.append(msg);
+    if (d->batch.size() >= d->batchMax)
+    {
+      flushBatch();
+    }
+  }
 }
 
 void QtMosquittoClient::message_cb_s(struct mosquitto*,void* obj,const struct mosquitto_message* msg)
@@ -336,7 +3329,47 @@ void QtMosquittoClient::message_cb_s(struct mosquitto*,void* obj,const struct mo
   QtMosquittoClient* self = static_cast<QtMosquittoClient*>(obj);
   Q_ASSERT(self != 0);
   Q_ASSERT(msg != 0);
-  QString topic(QString::fromUtf8(msg->topic));
-  QByteArray data(static_cast<char*>(msg->payload), msg->payloadlen);
-  self->message_cb(topic, data);
+  const qint64 received = self->d->metrics.start();
+  self->d->metrics.count(self->d->metrics.messagesIn);
+  self->d->metrics.count(self->d->metrics.bytesIn, msg->payloadlen);
+  // The payload is copied, or decoded, exactly once, every later copy of the
+  // message shares it. Topics found in the cache are shared as well.
+  const int topicLength = static_cast<int>(qstrlen(msg->topic));
+  TopicCache::Entry entry;
+  const bool interned = self->d->topicCache.intern(QByteArray::fromRawData(msg->topic, topicLength), entry);
+  const char* raw = static_cast<const char*>(msg->payload);
+  QByteArray payload;
+  if (!(self->d->decoding.load() && self->decodePayload(raw, msg->payloadlen, payload)))
+  {
+    payload = QByteArray(raw, msg->payloadlen);
+  }
+  QtMosquittoMessage message(interned ? entry.topic : QByteArray(msg->topic, topicLength), payload,
+                             msg->qos, msg->retain, msg->mid);
+  message.mTopicString = entry.string;
+  message.mTopicId = entry.id;
+  self->d->lastValues.update(message);
+  if (self->d->ioMode == ThreadedIo)
+  {
+    // Hand messages over in bursts, only the first message since the owner
+    // thread last drained the queue posts an event.
+    QMutexLocker lock(&self->d->incomingMutex);
+    if (msg->qos == 0 && self->d->incomingMax > 0 && self->d->incoming.size() >= self->d->incomingMax)
+    {
+      // The queue is not empty, so a drain is already posted and reports the drop
+      ++self->d->incomingDropped;
+      self->d->metrics.count(self->d->metrics.incomingDropped);
+      return;
+    }
+    self->d->incoming.append(message);
+    self->d->incomingTimes.append(received);
+    if (!self->d->incomingQueued)
+    {
+      self->d->incomingQueued = true;
+      QMetaObject::invokeMethod(self, "drainIncoming", Qt::QueuedConnection);
+    }
+  }
+  else
+  {
+    self->message_cb(message, received);
+  }
 }
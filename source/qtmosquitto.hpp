@@ -29,8 +29,14 @@ Contributors:
 #endif
 
 #include <QtCore>
+#include <functional>
 struct mosquitto;
 struct mosquitto_message;
+struct mqtt5__property;
+class QtMosquittoSpool;
+class QtMosquittoCodec;
+class QtMosquittoStreamSender;
+class QtMosquittoRecorder;
 
 /** Manage the initialisation and clean-up of the Mosquitto library.
  * An object of this class should be created on the stack in main() before any
@@ -47,6 +53,203 @@ class QTMOSQUITTO_EXPORT QtMosquittoApp
 };
 
 
+/** MQTT message received from the server.
+ * The topic is kept as the raw UTF-8 bytes sent by the server so receivers
+ * that only compare or hash topics never pay for a conversion to QString.
+ * Copies are cheap, the topic and payload are implicitly shared.
+ */
+class QTMOSQUITTO_EXPORT QtMosquittoMessage
+{
+  public:
+    /// Create a null message.
+    QtMosquittoMessage();
+
+    /** Create a message.
+     * \param topic    UTF-8 encoded topic, e.g a/b/c
+     * \param payload  Message payload.
+     * \param qos      Message QoS level.
+     * \param retain   True if the message was retained by the server.
+     * \param mid      Message ID.
+     */
+    QtMosquittoMessage(const QByteArray& topic, const QByteArray& payload, int qos = 0, bool retain = false, int mid = 0);
+
+    /// True if this is a default constructed message.
+    bool isNull() const { return mTopic.isNull(); }
+
+    /// UTF-8 encoded message topic.
+    const QByteArray& topic() const { return mTopic; }
+
+    /** Message topic converted to a QString.
+     * When the topic cache is enabled this is shared with every other message
+     * on the same topic and does not need converting.
+     * \sa QtMosquittoClient::setTopicCacheSize
+     */
+    QString topicString() const;
+
+    /** ID of the topic in the client's topic cache.
+     * \returns Topic ID, or -1 if the topic cache is disabled.
+     * \sa QtMosquittoClient::topicId
+     */
+    int topicId() const { return mTopicId; }
+
+    /// Message payload.
+    const QByteArray& payload() const { return mPayload; }
+
+    /// Message QoS level.
+    int qos() const { return mQos; }
+
+    /// True if the message was retained by the server.
+    bool retain() const { return mRetain; }
+
+    /// Message ID.
+    int mid() const { return mMid; }
+
+  private:
+    friend class QtMosquittoClient;
+    QByteArray mTopic;
+    QString mTopicString;
+    QByteArray mPayload;
+    int mTopicId;
+    int mMid;
+    int mQos;
+    bool mRetain;
+};
+
+Q_DECLARE_TYPEINFO(QtMosquittoMessage, Q_MOVABLE_TYPE);
+Q_DECLARE_METATYPE(QtMosquittoMessage)
+
+
+/** Topic prepared for publishing.
+ * The topic is validated and UTF-8 encoded once, publishing to it with
+ * QtMosquittoClient::publish does not convert or allocate.
+ */
+class QTMOSQUITTO_EXPORT QtMosquittoTopic
+{
+  public:
+    /// Create an invalid topic.
+    QtMosquittoTopic();
+
+    /** Create a topic.
+     * \param topic  Topic name, e.g a/b/c, wildcards are not allowed.
+     */
+    explicit QtMosquittoTopic(const QString& topic);
+
+    /** Create a topic from UTF-8 encoded bytes.
+     * \param topic  Topic name, e.g a/b/c, wildcards are not allowed.
+     */
+    explicit QtMosquittoTopic(const QByteArray& topic);
+
+    /// True if the topic can be published to.
+    bool isValid() const { return mValid; }
+
+    /// Topic name.
+    QString name() const;
+
+    /// UTF-8 encoded topic name.
+    const QByteArray& utf8() const { return mTopic; }
+
+  private:
+    QByteArray mTopic;
+    bool mValid;
+};
+
+Q_DECLARE_TYPEINFO(QtMosquittoTopic, Q_MOVABLE_TYPE);
+Q_DECLARE_METATYPE(QtMosquittoTopic)
+
+
+/** Snapshot of the runtime counters of a client.
+ * Latencies are kept as histograms with power of two buckets, bucket i counts
+ * samples shorter than 2^i microseconds and the last bucket counts every
+ * longer sample.
+ * \sa QtMosquittoClient::setMetricsEnabled
+ */
+struct QTMOSQUITTO_EXPORT QtMosquittoMetrics
+{
+  /// Number of buckets in each latency histogram.
+  enum { HistogramBuckets = 24 };
+
+  quint64 messagesIn;       ///< Messages received.
+  quint64 bytesIn;          ///< Payload bytes received.
+  quint64 messagesOut;      ///< Messages handed to the library by publish().
+  quint64 bytesOut;         ///< Payload bytes handed to the library by publish().
+  quint64 publishFailures;  ///< Calls to publish() that failed or were refused.
+  quint64 reconnects;       ///< Successful calls to doReconnect().
+  quint64 disconnects;      ///< Unexpected disconnections.
+  quint64 conflationDropped;  ///< Conflated messages replaced by a newer one before delivery.
+  quint64 conflationMerged;   ///< Conflated deliveries that stood for more than one message.
+  quint64 queueDropped;       ///< Messages refused by enqueuePublish() because the queue was full.
+  quint64 decodeRejected;     ///< Encoded payloads delivered undecoded because they exceeded the decode limits.
+  quint64 incomingDropped;    ///< Received QoS 0 messages dropped because the owner thread fell behind in ThreadedIo mode.
+  quint64 laneDropped;        ///< Messages refused or discarded because their priority lane was full.
+  QVector<int> laneDepths;    ///< Messages waiting in each priority lane, highest priority first.
+
+  /// Time spent inside each call to the network loop, not sampled in ThreadedIo mode.
+  quint64 loopTime[HistogramBuckets];
+
+  /// Time from a message being decoded until its handlers and slots returned.
+  quint64 deliveryLatency[HistogramBuckets];
+
+  /// Create a snapshot with every counter zeroed.
+  QtMosquittoMetrics();
+
+  /** Estimate a percentile from a latency histogram.
+   * \param histogram  One of the histograms of this snapshot.
+   * \param fraction   Percentile as a fraction, e.g 0.99
+   * \returns Upper bound in microseconds of the bucket holding the percentile.
+   */
+  static quint64 percentile(const quint64* histogram, double fraction);
+};
+
+Q_DECLARE_METATYPE(QtMosquittoMetrics)
+
+
+/** MQTT v5 properties sent with published messages.
+ * Ignored unless the client connects with MQTT v5.
+ * \sa QtMosquittoClient::setProtocolVersion, QtMosquittoClient::setPublishProperties
+ */
+struct QTMOSQUITTO_EXPORT QtMosquittoProperties
+{
+  /// Seconds the server keeps the message for subscribers yet to receive it, 0 to never expire.
+  int messageExpiry;
+
+  /// Name and value pairs passed through to subscribers.
+  QList<QPair<QString, QString> > userProperties;
+
+  /// Create an empty set of properties.
+  QtMosquittoProperties();
+
+  /// True if no property is set.
+  bool isEmpty() const;
+};
+
+
+/** Schedule of automatic reconnect attempts.
+ * The delay before attempt n is initialDelay * multiplier^(n - 1), capped at
+ * maxDelay. With jitter each delay is drawn uniformly between zero and that
+ * bound, so clients dropped by the same outage spread out their reconnects
+ * instead of all arriving at the server together.
+ * \sa QtMosquittoClient::setReconnectPolicy
+ */
+struct QTMOSQUITTO_EXPORT QtMosquittoReconnectPolicy
+{
+  int initialDelay;           ///< Bound of the first delay in milliseconds.
+  int maxDelay;               ///< Largest bound of a delay in milliseconds.
+  double multiplier;          ///< Growth of the bound per attempt.
+  bool jitter;                ///< Draw each delay between zero and its bound.
+  int maxAttempts;            ///< Attempts before giving up, 0 to never give up.
+  bool restoreSubscriptions;  ///< Resubscribe to previous subscriptions once reconnected.
+
+  /// Create the default policy, 1 s doubling up to 60 s with jitter and no attempt limit.
+  QtMosquittoReconnectPolicy();
+
+  /** Bound of the delay before an attempt.
+   * \param attempt  Attempt number, starting from 1.
+   * \returns Delay bound in milliseconds.
+   */
+  int delayBound(int attempt) const;
+};
+
+
 /** MQTT client connection to server.
  * Wrap the client functions in Mosquitto to provide a client connection to the
  * server.
@@ -62,9 +265,62 @@ class QTMOSQUITTO_EXPORT QtMosquittoClient : public QObject
       ConnectionRefusedProtocolVersion,
       ConnectionRefusedIdentifierRejected,
       ConnectionRefusedBrokerUnavailable,
-      UnexpectedDisconnect
+      UnexpectedDisconnect,
+      ReconnectFailed
+    };
+
+    /// Strategies for driving network I/O, selected with setIoMode().
+    enum IoMode
+    {
+      PollingIo,  ///< Poll the library from a 100 ms timer (default).
+      NotifierIo, ///< Service the socket as soon as QSocketNotifier reports it ready.
+      ThreadedIo  ///< Run the network loop in a dedicated libmosquitto thread.
+    };
+
+    /// Values returned by publish() when a message has not been sent.
+    enum PublishError
+    {
+      PublishQueued = 0,        ///< Held in the spool or a priority lane, it will be sent later.
+      PublishFailed = -1,       ///< The library failed to publish the message.
+      PublishBackpressure = -2  ///< Refused as the in-flight high watermark was reached or the priority lane is full.
     };
 
+    /// What publish() does when a priority lane is full, selected with setLaneCapacity().
+    enum LaneFullPolicy
+    {
+      LaneRefuse,     ///< Refuse the message, publish() returns PublishBackpressure.
+      LaneDropOldest  ///< Discard the oldest message of the lane to make room.
+    };
+
+    /// MQTT protocol versions, selected with setProtocolVersion().
+    enum ProtocolVersion
+    {
+      Mqtt31 = 3,
+      Mqtt311 = 4,  ///< Default.
+      Mqtt5 = 5
+    };
+
+    /// What enqueuePublish() does when the publish queue is full.
+    enum QueueFullPolicy
+    {
+      QueueDrop,   ///< Refuse the message, enqueuePublish() returns false.
+      QueueBlock   ///< Wait until the owner thread has made room.
+    };
+
+    /// Severity of library log messages, selected with setLogLevel().
+    enum LogLevel
+    {
+      LogDebug,
+      LogInfo,
+      LogNotice,
+      LogWarning,
+      LogError,
+      LogNone     ///< Do not log.
+    };
+
+    /// Handler called for messages matching a routed subscription.
+    typedef std::function<void(const QtMosquittoMessage&)> MessageHandler;
+
     /** Create the client.
      * \param id             Client ID - up to 23 characters to use as the
      *                           client ID, if empty a random ID will be
@@ -116,6 +372,339 @@ class QTMOSQUITTO_EXPORT QtMosquittoClient : public QObject
      */
     bool setMaxInflightMessages(int max_inflight_messages);
 
+    /** Select the MQTT protocol version.
+     * MQTT v5 needs libmosquitto 1.6 or later. With v5 QoS 0 messages are
+     * published with topic aliases, up to the Topic Alias Maximum announced
+     * by the server, so only the first message on a topic carries the topic
+     * string. Aliases belong to one network connection and are forgotten on
+     * every reconnect, messages that may be resent after a reconnect always
+     * carry the full topic.
+     * Must be called before doConnect.
+     * \returns True if the version was accepted, false otherwise.
+     */
+    bool setProtocolVersion(ProtocolVersion version);
+
+    /// MQTT protocol version used for connections.
+    ProtocolVersion protocolVersion() const;
+
+    /** Set the MQTT v5 Receive Maximum sent when connecting.
+     * Limits the number of QoS 1 and 2 messages the server sends before they
+     * have been acknowledged.
+     * Must be called before doConnect.
+     * \param receiveMaximum  From 1 to 65535, 0 to leave it to the server.
+     * \returns True if the value was accepted, false otherwise.
+     */
+    bool setReceiveMaximum(int receiveMaximum);
+
+    /// Enable or disable MQTT v5 topic aliases for publishing, enabled by default.
+    void setTopicAliasesEnabled(bool enabled);
+
+    /// Topic Alias Maximum announced by the server, 0 if aliases can not be used.
+    int topicAliasMaximum() const;
+
+    /** Set the MQTT v5 properties sent with every published message.
+     * \sa publish(const QtMosquittoTopic&, const QByteArray&, int, bool, const QtMosquittoProperties&)
+     */
+    void setPublishProperties(const QtMosquittoProperties& properties);
+
+    /// MQTT v5 properties sent with every published message.
+    QtMosquittoProperties publishProperties() const;
+
+    /** Set the in-flight watermarks used to signal backpressure.
+     * Messages published with QoS 1 or 2 are in flight until the server has
+     * acknowledged them. When the number in flight reaches the high watermark
+     * backpressure(true) is emitted, once it has dropped to the low watermark
+     * backpressure(false) is emitted.
+     * \param high  High watermark, 0 disables backpressure, which is the default.
+     * \param low   Low watermark, must be less than high.
+     * \returns True if the watermarks were accepted, false otherwise.
+     * \sa inflightMessages, setRejectOnBackpressure
+     */
+    bool setInflightWatermarks(int high, int low);
+
+    /** Refuse to publish while backpressure is active.
+     * When enabled publish() returns PublishBackpressure instead of handing
+     * the message to the library while the high watermark is exceeded.
+     */
+    void setRejectOnBackpressure(bool reject);
+
+    /// Number of QoS 1 and 2 messages that have not been acknowledged yet.
+    int inflightMessages() const;
+
+    /** Hold QoS 1 and 2 messages in priority lanes while in flight slots are used up.
+     * Once the number of messages in flight reaches the limit set with
+     * setMaxInflightMessages(), publish() queues QoS 1 and 2 messages in a lane
+     * and returns PublishQueued instead of leaving them to the FIFO queue of
+     * the library. Each acknowledgement frees a slot, which goes to the
+     * highest priority lane that still has credit in the current round. Every
+     * lane gets as many messages per round as its weight, so lower lanes
+     * still progress under sustained load. QoS 0 messages are never held.
+     * \param weights  Weight of each lane, highest priority first, each at
+     *                 least 1. Empty to disable lanes, which is the default.
+     * \returns True if the lanes were set, false if the weights are invalid or
+     *          messages are still held.
+     * \sa setPriorityRule, laneDepths
+     */
+    bool setPriorityLanes(const QVector<int>& weights);
+
+    /** Put messages published to topics matching a filter in a priority lane.
+     * Messages not matching any rule and published without a priority go to
+     * the lowest priority lane. When several filters match a topic the
+     * longest one is used.
+     * \param filter  Topic filter, wildcards are + for a single level and #
+     *                for multilevel.
+     * \param lane    Lane index, 0 being the highest priority. -1 to remove
+     *                the rule.
+     * \returns True if the rule was accepted, false otherwise.
+     */
+    bool setPriorityRule(const QString& filter, int lane);
+
+    /// Number of messages waiting in each priority lane, highest priority first.
+    QVector<int> laneDepths() const;
+
+    /** Limit the messages held in each priority lane.
+     * Messages refused or discarded because their lane is full are counted
+     * in QtMosquittoMetrics::laneDropped.
+     * \param capacity  Maximum number of messages in a lane, 0 for no limit.
+     *                  10000 by default.
+     * \param policy    What to do with a message for a full lane.
+     */
+    void setLaneCapacity(int capacity, LaneFullPolicy policy = LaneRefuse);
+
+    /** Keep QoS 1 and 2 messages that can not be sent yet in a spool.
+     * While the connection is not established, while backpressure is active
+     * and until every spooled message has been sent, publish() appends QoS 1
+     * and 2 messages to the spool and returns PublishQueued instead of
+     * failing or refusing them. Once connected the spool is drained in order,
+     * pausing while backpressure is active.
+     * \param spool          Open spool, it is not owned by the client. 0 to
+     *                       stop spooling, spooled messages stay in the file.
+     * \param drainRate      Maximum number of messages sent per drain.
+     * \param drainInterval  Interval in milliseconds between drains.
+     */
+    void setSpool(QtMosquittoSpool* spool, int drainRate = 100, int drainInterval = 10);
+
+    /// Spool used for messages that can not be sent yet, or 0.
+    QtMosquittoSpool* spool() const;
+
+    /** Record every message delivered and published.
+     * Received messages are recorded after decoding as they are delivered,
+     * messages dropped by conflation or the incoming queue limit are not
+     * recorded. Published messages are recorded as passed to publish(),
+     * before encoding, once the client has sent or queued them. The recorder
+     * is only used from the thread owning the client, so it can be deleted
+     * as soon as this returns with 0 or another recorder.
+     * \param recorder  Open recorder, it is not owned by the client. 0 to stop
+     *                  recording.
+     * \sa QtMosquittoRecorder, QtMosquittoReplayer
+     */
+    void setRecorder(QtMosquittoRecorder* recorder);
+
+    /// Recorder messages are recorded to, or 0.
+    QtMosquittoRecorder* recorder() const;
+
+    /** Make a codec available for decoding received payloads.
+     * Payloads starting with the header of a registered codec are decoded
+     * before they are delivered, other payloads are delivered unchanged.
+     * \param codec  Codec to register, it is not owned by the client.
+     * \sa QtMosquittoCodec
+     */
+    void registerCodec(QtMosquittoCodec* codec);
+
+    /** Encode the payloads published to topics matching a filter.
+     * When several filters match a topic the longest one is used. The codec
+     * is registered for decoding as well.
+     * \param filter  Topic filter, wildcards are + for a single level and #
+     *                for multilevel.
+     * \param codec   Codec to use, it is not owned by the client. 0 to stop
+     *                encoding for the filter.
+     * \returns True if the filter was accepted, false otherwise.
+     */
+    bool setPublishCodec(const QString& filter, QtMosquittoCodec* codec);
+
+    /** Limit the size received payloads are decoded to.
+     * The decoded size is read from the payload header, so without a limit
+     * any publisher could make the client allocate up to 256 MiB per
+     * message. Payloads over either limit are delivered undecoded and
+     * counted in QtMosquittoMetrics::decodeRejected.
+     * \param maxSize   Largest decoded payload in bytes, 16 MiB by default.
+     * \param maxRatio  Largest decoded size as a multiple of the received
+     *                  size, 1024 by default, 0 for no ratio limit.
+     */
+    void setMaxDecodedSize(int maxSize, int maxRatio = 1024);
+
+    /// Largest decoded payload in bytes.
+    int maxDecodedSize() const;
+
+    /** Set the minimum severity of library messages to log.
+     * Messages are written to the "qtmosquitto" logging category, so they
+     * can also be filtered with QLoggingCategory rules. The library only
+     * formats messages while something is logged or logMessage() is
+     * connected, at LogNone logging costs nothing.
+     * \param level  Minimum level, LogNone by default.
+     */
+    void setLogLevel(LogLevel level);
+
+    /// Minimum severity of library messages to log.
+    LogLevel logLevel() const;
+
+    /** Set the schedule of automatic reconnect attempts.
+     * \sa setAutoReconnect, reconnecting
+     */
+    void setReconnectPolicy(const QtMosquittoReconnectPolicy& policy);
+
+    /// Schedule of automatic reconnect attempts.
+    QtMosquittoReconnectPolicy reconnectPolicy() const;
+
+    /** Select how network I/O is driven.
+     * PollingIo calls into the library every 100 ms, NotifierIo reads and
+     * writes the socket when it becomes ready and only wakes for keepalive
+     * processing when idle.
+     * ThreadedIo runs the network loop with mosquitto_loop_start(), so
+     * keepalives and socket reads are not held up by a busy owner thread.
+     * Library callbacks are queued back to the thread this object lives in,
+     * all signals are still emitted from that thread.
+     * Must be called before doConnect.
+     * \param mode  I/O mode to use for subsequent connections.
+     * \returns True if the mode was changed, false otherwise.
+     */
+    bool setIoMode(IoMode mode);
+
+    /// Current I/O mode.
+    IoMode ioMode() const;
+
+    /** Enable batched delivery of received messages.
+     * Received messages are collected and emitted together by the messages()
+     * signal, so receivers, especially ones in other threads, handle one
+     * event per batch instead of one per message. A batch is emitted once it
+     * is full or its first message has been held for maxDelay, whichever
+     * comes first. In ThreadedIo mode the network thread also hands messages
+     * to the owner thread a burst at a time.
+     * \param maxBatch  Maximum number of messages in a batch, 0 disables
+     *                  batching, which is the default.
+     * \param maxDelay  Maximum time in milliseconds the first message of a
+     *                  batch is held before the batch is emitted.
+     */
+    void setBatchDelivery(int maxBatch, int maxDelay = 10);
+
+    /** Limit the QoS 0 messages waiting to be handed to the owner thread.
+     * Only used in ThreadedIo mode. QoS 0 messages received while the owner
+     * thread is this far behind are dropped, counted in
+     * QtMosquittoMetrics::incomingDropped and reported by messagesDropped().
+     * QoS 1 and 2 messages have already been acknowledged to the server and
+     * are never dropped.
+     * \param maxMessages  Maximum number of waiting messages, 0 for no
+     *                     limit, which is the default.
+     */
+    void setIncomingQueueLimit(int maxMessages);
+
+    /** Enable collection of runtime metrics.
+     * Counters are updated with atomic operations from whichever thread does
+     * the work, when disabled only a flag is checked.
+     * \param enabled   True to collect metrics, disabled by default.
+     * \param interval  Interval in milliseconds at which metricsUpdated() is
+     *                  emitted, 0 to only read them with metrics().
+     */
+    void setMetricsEnabled(bool enabled, int interval = 0);
+
+    /// Snapshot of the current metrics.
+    QtMosquittoMetrics metrics() const;
+
+    /// Reset every metric to zero.
+    void resetMetrics();
+
+    /** Set the size of the received topic cache.
+     * Received topics are interned in a table keyed by their UTF-8 bytes, so
+     * messages on a topic already in the table share its QString and carry a
+     * stable integer ID that can be used instead of string compares.
+     * \param maxTopics  Maximum number of topics kept, the least recently
+     *                   received topic is evicted first. 0 disables the
+     *                   cache, which is the default.
+     * \sa QtMosquittoMessage::topicId
+     */
+    void setTopicCacheSize(int maxTopics);
+
+    /// Maximum number of topics in the received topic cache.
+    int topicCacheSize() const;
+
+    /** Get the ID of a topic, adding it to the topic cache if needed.
+     * IDs stay the same for as long as the topic remains in the cache, size
+     * the cache to hold the whole working set of topics.
+     * \param topic  Full topic name, without wildcards.
+     * \returns Topic ID, or -1 if the topic cache is disabled.
+     */
+    int topicId(const QString& topic);
+
+    /** Get the topic for an ID from the topic cache.
+     * \returns Topic, or a null string if the ID is not in the cache.
+     */
+    QString topicForId(int id) const;
+
+    /** Conflate the messages received on topics matching a filter.
+     * Each matching topic is delivered at most once per interval. A message
+     * arriving sooner is held, replacing any message already held for its
+     * topic, and delivered once the interval has passed. Slow consumers such
+     * as user interfaces then only see the latest value of a fast topic.
+     * When several filters match a topic the longest one is used, use # to
+     * set a rate for every topic.
+     * Handlers, message(), messageReceived() and messages() all see the
+     * conflated stream.
+     * \param filter    Topic filter, wildcards are + for a single level and #
+     *                  for multilevel.
+     * \param interval  Minimum time in milliseconds between deliveries on a
+     *                  topic, 0 to stop conflating the filter.
+     * \returns True if the filter was accepted, false otherwise.
+     * \sa QtMosquittoMetrics::conflationDropped
+     */
+    bool setConflation(const QString& filter, int interval);
+
+    /** Limit the conflated deliveries across all topics.
+     * Applies on top of the per topic intervals of setConflation(), to
+     * messages on conflated topics only. When the limit is reached messages
+     * stay held, still replaced by newer ones, and the topics held longest
+     * are delivered first. Bursts of up to one second's worth are allowed.
+     * \param maxRate  Maximum deliveries per second, 0 for no limit, which
+     *                 is the default.
+     */
+    void setConflationRate(int maxRate);
+
+    /** Keep the last message received on each topic.
+     * Every received message, retained or not, replaces the cached value for
+     * its topic, a retained message with an empty payload removes it. The
+     * latest value of a topic can then be read straight from memory instead
+     * of subscribing again and waiting for the server to resend it.
+     * \param maxBytes  Memory budget for the cached topics and payloads, the
+     *                  least recently updated topics are evicted first. 0
+     *                  disables and clears the cache, which is the default.
+     */
+    void setLastValueCacheSize(qint64 maxBytes);
+
+    /// Memory budget of the last value cache in bytes.
+    qint64 lastValueCacheSize() const;
+
+    /** Get the last message received on a topic.
+     * \param topic  Full topic name, without wildcards.
+     * \returns Last message, or a null message if there is none cached.
+     */
+    QtMosquittoMessage lastValue(const QString& topic) const;
+
+    /** Get the last message received on every cached topic matching a filter.
+     * The messages share their topics and payloads with the cache, so taking
+     * a snapshot does not copy them.
+     * \param filter  Topic filter, wildcards are + for a single level and #
+     *                for multilevel.
+     * \returns Matching messages, in no particular order.
+     */
+    QVector<QtMosquittoMessage> lastValues(const QString& filter) const;
+
+    /** Check whether a topic matches a topic filter.
+     * \param filter  Topic filter, wildcards are + for a single level and #
+     *                for multilevel.
+     * \param topic   Full topic name, e.g a/b/c
+     * \returns True if the filter is valid and matches the topic.
+     */
+    static bool topicMatches(const QByteArray& filter, const QByteArray& topic);
+
     /** Start connecting to the server.
      * Start connecting to the server, the connection will not have completed
      * before the call returns.
@@ -127,12 +716,15 @@ class QTMOSQUITTO_EXPORT QtMosquittoClient : public QObject
      */
     bool doConnect(const QString& host, int port = 1883, int keepalive = 60);
 
+    /// True while the client is connected or connecting to the server.
+    bool isConnected() const;
+
     /** Publish a message to the server.
      * \param topic     Topic of message, e.g a/b/c
      * \param payload   Payload of message as string.
      * \param qos       Message QoS level.
      * \param retain    Flag to indicate server should hold message.
-     * \returns Message ID on success or -1 on failure.
+     * \returns Message ID on success or a PublishError on failure.
      */
     int publish(const QString& topic, const QString& payload, int qos = 0, bool retain = false);
 
@@ -141,10 +733,82 @@ class QTMOSQUITTO_EXPORT QtMosquittoClient : public QObject
      * \param payload   Payload of message as binary data.
      * \param qos       Message QoS level.
      * \param retain    Flag to indicate server should hold message.
-     * \returns Message ID on success or -1 on failure.
+     * \returns Message ID on success or a PublishError on failure.
      */
     int publish(const QString& topic, const QByteArray& payload, int qos = 0, bool retain = false);
 
+    /** Publish a message to a prepared topic.
+     * This is the fastest way to publish repeatedly to the same topics, the
+     * encoded topic is passed straight to the library.
+     * \param topic     Topic of message.
+     * \param payload   Payload of message as binary data.
+     * \param qos       Message QoS level.
+     * \param retain    Flag to indicate server should hold message.
+     * \returns Message ID on success or a PublishError on failure.
+     */
+    int publish(const QtMosquittoTopic& topic, const QByteArray& payload, int qos = 0, bool retain = false);
+
+    /** Publish a message to a prepared topic with MQTT v5 properties.
+     * The properties are used instead of those set with
+     * setPublishProperties(). They are not kept for messages stored in the
+     * spool, which are sent with the default properties.
+     * \param topic       Topic of message.
+     * \param payload     Payload of message as binary data.
+     * \param qos         Message QoS level.
+     * \param retain      Flag to indicate server should hold message.
+     * \param properties  Properties of the message.
+     * \returns Message ID on success or a PublishError on failure.
+     */
+    int publish(const QtMosquittoTopic& topic, const QByteArray& payload, int qos, bool retain, const QtMosquittoProperties& properties);
+
+    /** Publish a message to a prepared topic in a given priority lane.
+     * \param topic     Topic of message.
+     * \param payload   Payload of message as binary data.
+     * \param qos       Message QoS level.
+     * \param retain    Flag to indicate server should hold message.
+     * \param priority  Lane index, 0 being the highest priority, overriding
+     *                  the rules set with setPriorityRule().
+     * \returns Message ID on success or a PublishError on failure.
+     * \sa setPriorityLanes
+     */
+    int publish(const QtMosquittoTopic& topic, const QByteArray& payload, int qos, bool retain, int priority);
+
+    /** Create the queue used by enqueuePublish().
+     * Must be called from the thread owning the client before any thread
+     * calls enqueuePublish(), the queue can not be resized later.
+     * \param capacity  Number of messages held, rounded up to a power of two.
+     * \param policy    What to do when the queue is full.
+     * \returns True if the queue was created, false otherwise.
+     */
+    bool setPublishQueue(int capacity, QueueFullPolicy policy = QueueDrop);
+
+    /** Queue a message to be published, may be called from any thread.
+     * Messages are taken off the queue in batches by the thread owning the
+     * client and passed to publish(), so message IDs and errors are not
+     * returned, failures are only counted in the metrics. Only the first
+     * message queued since the last batch posts an event to the owner thread,
+     * the queue itself does not take a lock.
+     * \param topic    Topic of message.
+     * \param payload  Payload of message as binary data.
+     * \param qos      Message QoS level.
+     * \param retain   Flag to indicate server should hold message.
+     * \returns True if the message was queued, false if the queue is full with
+     *          the QueueDrop policy or was never created.
+     */
+    bool enqueuePublish(const QtMosquittoTopic& topic, const QByteArray& payload, int qos = 0, bool retain = false);
+
+    /** Publish the contents of a device as a stream of chunk messages.
+     * The sender is owned by the client and deletes itself once it has
+     * emitted finished().
+     * \param topic      Topic the stream is published to.
+     * \param source     Open device to read from, it is not owned by the client.
+     * \param chunkSize  Largest number of bytes in one chunk.
+     * \param qos        Message QoS level.
+     * \returns The running sender, or 0 if the stream could not be started.
+     * \sa QtMosquittoStreamSender, QtMosquittoStreamReceiver
+     */
+    QtMosquittoStreamSender* publishStream(const QtMosquittoTopic& topic, QIODevice* source, int chunkSize = 65536, int qos = 1);
+
     /** Subscribe to messages with the given topic.
      * \param topic  Message topic to receive, wildcards are + for a single
      *                   level and # for multilevel.
@@ -155,11 +819,94 @@ class QTMOSQUITTO_EXPORT QtMosquittoClient : public QObject
     bool subscribe(const QString& topic, int qos = 0);
 
     /** Unsubscribe from messages with the given topic.
+     * The server subscription is kept while a handler added with the
+     * handler overload of subscribe() still uses the same filter.
      * \param[in] topic  Message topic to no longer receive.
-     * \returns True if unsubscribe sent, false otherwise.
+     * \returns True if unsubscribe sent or the filter is still used by a
+     *          handler, false otherwise.
      */
     bool unsubscribe(const QString& topic);
 
+    /** Subscribe to several topics with a single SUBSCRIBE packet.
+     * \param topics  Message topics to receive, wildcards are + for a single
+     *                level and # for multilevel.
+     * \param qos     Message QoS for every topic.
+     * \returns Message ID of the SUBSCRIBE on success, -1 on failure.
+     * \sa subscribed
+     */
+    int subscribe(const QStringList& topics, int qos = 0);
+
+    /** Unsubscribe from several topics with a single UNSUBSCRIBE packet.
+     * Topics still used by a handler keep their server subscription and are
+     * left out of the packet.
+     * \param topics  Message topics to no longer receive.
+     * \returns Message ID of the UNSUBSCRIBE on success, 0 if every topic is
+     *          still used by a handler, -1 on failure.
+     * \sa unsubscribed
+     */
+    int unsubscribe(const QStringList& topics);
+
+    /** Publish a message and get a future for its completion.
+     * The future finishes with the message ID once published() would be
+     * emitted for it, so it can be waited on with a QFutureWatcher instead of
+     * tracking message IDs.
+     * The future is cancelled if the message could not be published or the
+     * client disconnects before the message completed. A message held in the
+     * spool or a priority lane keeps the future pending until it is sent and
+     * completed, the future is cancelled if the message is discarded to make
+     * room for newer ones.
+     * \param topic     Topic of message, e.g a/b/c
+     * \param payload   Payload of message as binary data.
+     * \param qos       Message QoS level.
+     * \param retain    Flag to indicate server should hold message.
+     * \returns Future for the message ID.
+     */
+    QFuture<int> publishAsync(const QString& topic, const QByteArray& payload, int qos = 0, bool retain = false);
+
+    /** Subscribe to a topic and get a future for the acknowledgement.
+     * The future is cancelled if the subscribe could not be sent, the server
+     * rejected it or the client disconnects before the SUBACK is received.
+     * \param topic  Message topic to receive.
+     * \param qos    Message QoS.
+     * \returns Future for the QoS granted by the server.
+     */
+    QFuture<int> subscribeAsync(const QString& topic, int qos = 0);
+
+    /** Unsubscribe from a topic and get a future for the acknowledgement.
+     * The future is cancelled if the unsubscribe could not be sent or the
+     * client disconnects before the UNSUBACK is received. It finishes straight
+     * away if a handler still uses the topic, which keeps the subscription.
+     * \param topic  Message topic to no longer receive.
+     * \returns Future finishing once the server has acknowledged.
+     */
+    QFuture<void> unsubscribeAsync(const QString& topic);
+
+    /** Subscribe to messages and route them to a handler.
+     * Messages are matched against all routed subscriptions with a single
+     * walk of a topic filter trie, only matching handlers are called.
+     * Routed subscriptions are reference counted, the SUBSCRIBE is only sent
+     * for the first handler registered for a filter.
+     * Handlers are called in the thread this object lives in, in addition to
+     * the message() and messageReceived() signals being emitted.
+     * \param filter   Topic filter, wildcards are + for a single level and #
+     *                 for multilevel.
+     * \param qos      Message QoS used if a SUBSCRIBE is sent.
+     * \param context  If set, the handler is removed when this object is
+     *                 destroyed.
+     * \param handler  Function to call with each matching message.
+     * \returns Handler ID on success or -1 on failure.
+     * \sa unsubscribe(int)
+     */
+    int subscribe(const QString& filter, int qos, QObject* context, const MessageHandler& handler);
+
+    /** Remove a handler registered with subscribe().
+     * The UNSUBSCRIBE is only sent when the last handler for a filter is
+     * removed and the filter was not also subscribed with subscribe().
+     * \param handlerId  ID returned by subscribe().
+     * \returns True if the handler was removed, false otherwise.
+     */
+    bool unsubscribe(int handlerId);
+
   public slots:
     /** Reconnect to a server when the client has been disconnected.
      * \returns True if connection is restarting, false otherwise.
@@ -174,7 +921,10 @@ class QTMOSQUITTO_EXPORT QtMosquittoClient : public QObject
     bool doDisconnect();
 
     /** Enable automatic reconnect mode.
-     * Enable an automatic reconnect when the connection has failed.
+     * Enable an automatic reconnect when the connection has failed. Attempts
+     * are made on the schedule of the reconnect policy until one succeeds,
+     * error(ReconnectFailed) is emitted if the policy gives up.
+     * \sa setReconnectPolicy
      */
     void setAutoReconnect(bool reconnect);
 
@@ -193,6 +943,12 @@ class QTMOSQUITTO_EXPORT QtMosquittoClient : public QObject
     /** Emitted when an error occurs. */
     void error(ClientError clientError);
 
+    /** Emitted when an automatic reconnect attempt has been scheduled.
+     * \param attempt  Attempt number, starting from 1.
+     * \param delay    Milliseconds until the attempt is made.
+     */
+    void reconnecting(int attempt, int delay);
+
     /** Emitted when a message is received for a subscription.
      * \param topic    Message topic, this is the full topic, even if the
      *                 subscription contained a wildcard.
@@ -200,20 +956,139 @@ class QTMOSQUITTO_EXPORT QtMosquittoClient : public QObject
      */
     void message(const QString& topic, const QByteArray& payload);
 
+    /** Emitted when a message is received for a subscription.
+     * Unlike message() the topic is not converted to a QString, which is only
+     * done when message() is connected.
+     * \param message  Received message.
+     */
+    void messageReceived(const QtMosquittoMessage& message);
+
+    /** Emitted with a batch of received messages.
+     * Only emitted when batched delivery is enabled, message() and
+     * messageReceived() are still emitted for every message before this.
+     * \param batch  Received messages, oldest first.
+     * \sa setBatchDelivery
+     */
+    void messages(const QVector<QtMosquittoMessage>& batch);
+
+    /** Emitted when the server has acknowledged a subscribe.
+     * \param mid         Message ID returned by subscribe(const QStringList&, int).
+     * \param grantedQos  QoS granted for each topic in the order they were
+     *                    given, 0x80 if the server refused a topic.
+     */
+    void subscribed(int mid, const QVector<int>& grantedQos);
+
+    /** Emitted when the server has acknowledged an unsubscribe.
+     * \param mid  Message ID returned by unsubscribe(const QStringList&).
+     */
+    void unsubscribed(int mid);
+
+    /** Emitted when a published message has completed.
+     * For QoS 0 this is when the message has been written to the network,
+     * for QoS 1 and 2 when the server has acknowledged it.
+     * \param mid  Message ID returned by publish().
+     */
+    void published(int mid);
+
+    /** Emitted when the in-flight watermarks are crossed.
+     * \param active  True when the high watermark has been reached, false
+     *                once the low watermark has been reached again.
+     * \sa setInflightWatermarks
+     */
+    void backpressure(bool active);
+
+    /** Emitted when received messages were dropped because the owner thread fell behind.
+     * \param count  Messages dropped since the signal was last emitted.
+     * \sa setIncomingQueueLimit
+     */
+    void messagesDropped(int count);
+
+    /** Emitted for every library log message while a receiver is connected.
+     * This is independent of the log level, so messages can be captured
+     * without also being written to the log.
+     * \param level  Severity of the message.
+     * \param text   Message text.
+     */
+    void logMessage(QtMosquittoClient::LogLevel level, const QString& text);
+
+    /** Emitted periodically while metrics are enabled.
+     * \sa setMetricsEnabled
+     */
+    void metricsUpdated(const QtMosquittoMetrics& metrics);
+
+  protected:
+    virtual void connectNotify(const QMetaMethod& signal);
+    virtual void disconnectNotify(const QMetaMethod& signal);
+
   private slots:
     void process();
+    void socketRead();
+    void socketWrite();
+    void socketMisc();
+    void connect_cb(int rc);
+    void disconnect_cb(int rc);
+    void drainIncoming();
+    void emitMetrics();
+    void drainSpool();
+    void reconnectTimeout();
+    void conflationTimeout();
+    void flushBatch();
+    void drainPublishQueue();
+    void publish_cb(int mid);
+    void subscribe_cb(int mid, const QVector<int>& grantedQos);
+    void unsubscribe_cb(int mid);
+    void handlerContextDestroyed(QObject* context);
 
   private:
-    void connect_cb(int rc);
+    void message_cb(const QtMosquittoMessage& msg, qint64 received);
+    void deliver(const QtMosquittoMessage& msg, qint64 received);
+    bool conflate(const QtMosquittoMessage& msg);
+    void flushConflation(bool all);
+    void armConflationTimer(qint64 due, qint64 now);
+    int doPublish(const QByteArray& topic, const QByteArray& payload, int qos, bool retain,
+                  const QtMosquittoProperties* properties = 0, int lane = -1);
+    int routePublish(const QByteArray& topic, const QByteArray& payload, int qos, bool retain,
+                     const QtMosquittoProperties* properties = 0, int lane = -1);
+    int sendPublish(const QByteArray& topic, const char* payload, int payloadlen, int qos, bool retain, int& mid,
+                    const QtMosquittoProperties* properties = 0);
+    int sendPublishV5(const QByteArray& topic, const char* payload, int payloadlen, int qos, bool retain, int& mid,
+                      const QtMosquittoProperties& properties);
+    QtMosquittoCodec* encoderFor(const QByteArray& topic) const;
+    int encodePayload(QtMosquittoCodec* codec, const QByteArray& payload);
+    bool decodePayload(const char* data, int size, QByteArray& payload);
+    int spoolPublish(const QByteArray& topic, const QByteArray& payload, int qos, bool retain);
+    void startDrain();
+    void releaseSpoolFuture(int mid);
+    int lanePublish(const QByteArray& topic, const QByteArray& payload, int qos, bool retain, int lane);
+    int nextLane();
+    void feedLanes();
+    void scheduleReconnect();
+    void restoreSubscriptions();
+    int subscribeMultiple(const QList<QByteArray>& topics, int qos);
+    bool serverSubscribe(const QByteArray& topic, int qos);
+    bool serverUnsubscribe(const QByteArray& topic);
+    void updateLogCallback();
+    void cancelPending();
+    void route(const QtMosquittoMessage& msg);
+    void startIo();
+    void stopIo();
+    void stopThread();
+    void updateIo();
     static void connect_cb_s(struct mosquitto*, void* obj, int rc);
-    void disconnect_cb(int rc);
-    static void disconnect_cb_s(struct mosquitto*, void* obj, int rc);
+    static void connect_v5_cb_s(struct mosquitto*, void* obj, int rc, int flags, const struct mqtt5__property* props);
+    static void disconnect_cb_s(struct mosquitto* mosq, void* obj, int rc);
+    static void publish_cb_s(struct mosquitto*, void* obj, int mid);
+    static void subscribe_cb_s(struct mosquitto*, void* obj, int mid, int qos_count, const int* granted_qos);
+    static void unsubscribe_cb_s(struct mosquitto*, void* obj, int mid);
     static void log_cb_s(struct mosquitto*,void* obj, int level, const char* str);
-    void message_cb(const QString& topic, const QByteArray& payload);
     static void message_cb_s(struct mosquitto*,void* obj,const struct mosquitto_message* msg);
+    /// Feeds synthetic messages through message_cb_s in the benchmarks.
+    friend class QtMosquittoClientBench;
     struct data;
     data* d;
     Q_DISABLE_COPY(QtMosquittoClient)
 };
 
+Q_DECLARE_METATYPE(QtMosquittoClient::LogLevel)
+
 #endif
@@ -0,0 +1,136 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#include "qtmosquittocodec.hpp"
+
+#include <zlib.h>
+
+#include <cstring>
+
+QtMosquittoCodec::~QtMosquittoCodec()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+quint8 QtMosquittoRawCodec::id() const
+{
+  return Id;
+}
+
+int QtMosquittoRawCodec::maxEncodedSize(int size) const
+{
+  return size;
+}
+
+int QtMosquittoRawCodec::encode(const char* data, int size, char* out)
+{
+  memcpy(out, data, size);
+  return size;
+}
+
+bool QtMosquittoRawCodec::decode(const char* data, int size, char* out, int decodedSize)
+{
+  if (size != decodedSize)
+  {
+    return false;
+  }
+  memcpy(out, data, size);
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct QtMosquittoZlibCodec::data
+{
+  QMutex deflateMutex;
+  z_stream deflater;
+  bool deflaterReady;
+  QMutex inflateMutex;
+  z_stream inflater;
+  bool inflaterReady;
+
+  data():deflateMutex(),deflater(),deflaterReady(false),inflateMutex(),inflater(),inflaterReady(false){}
+};
+
+
+QtMosquittoZlibCodec::QtMosquittoZlibCodec(int level) :
+  d(new data())
+{
+  d->deflaterReady = (deflateInit(&d->deflater, qBound(1, level, 9)) == Z_OK);
+  d->inflaterReady = (inflateInit(&d->inflater) == Z_OK);
+  if (!d->deflaterReady || !d->inflaterReady)
+  {
+    qWarning() << "QtMosquittoZlibCodec: Failed to initialise zlib";
+  }
+}
+
+QtMosquittoZlibCodec::~QtMosquittoZlibCodec()
+{
+  if (d->deflaterReady)
+  {
+    deflateEnd(&d->deflater);
+  }
+  if (d->inflaterReady)
+  {
+    inflateEnd(&d->inflater);
+  }
+  delete d;
+  d = 0;
+}
+
+quint8 QtMosquittoZlibCodec::id() const
+{
+  return Id;
+}
+
+int QtMosquittoZlibCodec::maxEncodedSize(int size) const
+{
+  return static_cast<int>(compressBound(size));
+}
+
+int QtMosquittoZlibCodec::encode(const char* data, int size, char* out)
+{
+  QMutexLocker lock(&d->deflateMutex);
+  if (!d->deflaterReady || deflateReset(&d->deflater) != Z_OK)
+  {
+    return -1;
+  }
+  d->deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  d->deflater.avail_in = size;
+  d->deflater.next_out = reinterpret_cast<Bytef*>(out);
+  d->deflater.avail_out = maxEncodedSize(size);
+  if (deflate(&d->deflater, Z_FINISH) != Z_STREAM_END)
+  {
+    return -1;
+  }
+  return static_cast<int>(d->deflater.total_out);
+}
+
+bool QtMosquittoZlibCodec::decode(const char* data, int size, char* out, int decodedSize)
+{
+  QMutexLocker lock(&d->inflateMutex);
+  if (!d->inflaterReady || inflateReset(&d->inflater) != Z_OK)
+  {
+    return false;
+  }
+  d->inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  d->inflater.avail_in = size;
+  d->inflater.next_out = reinterpret_cast<Bytef*>(out);
+  d->inflater.avail_out = decodedSize;
+  return inflate(&d->inflater, Z_FINISH) == Z_STREAM_END &&
+         d->inflater.total_out == static_cast<uLong>(decodedSize);
+}
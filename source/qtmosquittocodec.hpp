@@ -0,0 +1,103 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#ifndef QTMOSQUITTOCODEC_HPP
+#define QTMOSQUITTOCODEC_HPP
+
+#include "qtmosquitto.hpp"
+
+/** Payload encoding applied by QtMosquittoClient.
+ * Encoded payloads start with an 8 byte header, the bytes 0xFE 'Q' 'M', the
+ * codec ID and the decoded size as a little endian 32 bit integer. Receivers
+ * pick the codec from the header, so one topic can carry payloads encoded by
+ * different codecs, or not encoded at all.
+ * A codec may be used by several clients, each from its own threads, so
+ * implementations must be thread safe.
+ * \sa QtMosquittoClient::setPublishCodec, QtMosquittoClient::registerCodec
+ */
+class QTMOSQUITTO_EXPORT QtMosquittoCodec
+{
+  public:
+    /// Size of the header in front of every encoded payload.
+    enum { HeaderSize = 8 };
+
+    virtual ~QtMosquittoCodec();
+
+    /// ID written in the header, unique among the codecs of a client.
+    virtual quint8 id() const = 0;
+
+    /// Largest encoded size of a payload of the given size.
+    virtual int maxEncodedSize(int size) const = 0;
+
+    /** Encode a payload.
+     * \param data  Payload to encode.
+     * \param size  Size of the payload.
+     * \param out   Buffer with room for maxEncodedSize(size) bytes.
+     * \returns Encoded size, or -1 on failure.
+     */
+    virtual int encode(const char* data, int size, char* out) = 0;
+
+    /** Decode a payload.
+     * \param data         Encoded payload, without the header.
+     * \param size         Size of the encoded payload.
+     * \param out          Buffer with room for decodedSize bytes.
+     * \param decodedSize  Decoded size recorded in the header.
+     * \returns True if exactly decodedSize bytes were decoded.
+     */
+    virtual bool decode(const char* data, int size, char* out, int decodedSize) = 0;
+};
+
+
+/// Codec storing payloads unchanged, only marking them with the header.
+class QTMOSQUITTO_EXPORT QtMosquittoRawCodec : public QtMosquittoCodec
+{
+  public:
+    enum { Id = 0 };
+
+    virtual quint8 id() const;
+    virtual int maxEncodedSize(int size) const;
+    virtual int encode(const char* data, int size, char* out);
+    virtual bool decode(const char* data, int size, char* out, int decodedSize);
+};
+
+
+/** Codec compressing payloads with zlib.
+ * The compression and decompression streams are kept between messages, so
+ * coding a payload does not allocate.
+ */
+class QTMOSQUITTO_EXPORT QtMosquittoZlibCodec : public QtMosquittoCodec
+{
+  public:
+    enum { Id = 1 };
+
+    /** Create the codec.
+     * \param level  zlib compression level, from 1 (fastest) to 9 (smallest).
+     */
+    explicit QtMosquittoZlibCodec(int level = 6);
+    virtual ~QtMosquittoZlibCodec();
+
+    virtual quint8 id() const;
+    virtual int maxEncodedSize(int size) const;
+    virtual int encode(const char* data, int size, char* out);
+    virtual bool decode(const char* data, int size, char* out, int decodedSize);
+
+  private:
+    struct data;
+    data* d;
+    Q_DISABLE_COPY(QtMosquittoZlibCodec)
+};
+
+#endif
@@ -0,0 +1,187 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#include "qtmosquittopool.hpp"
+
+struct QtMosquittoClientPool::data
+{
+  QVector<QtMosquittoClient*> shards;
+  QVector<bool> shardConnected;
+  bool connected;
+
+  data():shards(),shardConnected(),connected(false){}
+};
+
+
+QtMosquittoClientPool::QtMosquittoClientPool(int shards, const QString& id, bool clean_session, QObject* par) :
+  QObject(par),
+  d(new data())
+{
+  Q_ASSERT(shards > 0);
+  for (int i = 0; i < qMax(1, shards); ++i)
+  {
+    const QString shardId = id.isEmpty() ? QString() : (id + QString::number(i));
+    QtMosquittoClient* client = new QtMosquittoClient(shardId, clean_session, this);
+    client->setIoMode(QtMosquittoClient::ThreadedIo);
+    connect(client, SIGNAL(connectState(bool)), this, SLOT(shardConnectState(bool)));
+    connect(client, &QtMosquittoClient::error, this, &QtMosquittoClientPool::shardError);
+    connect(client, SIGNAL(messageReceived(QtMosquittoMessage)), this, SIGNAL(messageReceived(QtMosquittoMessage)));
+    d->shards.append(client);
+    d->shardConnected.append(false);
+  }
+}
+
+QtMosquittoClientPool::~QtMosquittoClientPool()
+{
+  // Shards are children and disconnect themselves when deleted
+  qDeleteAll(d->shards);
+  delete d;
+  d = 0;
+}
+
+int QtMosquittoClientPool::shardCount() const
+{
+  return d->shards.size();
+}
+
+QtMosquittoClient* QtMosquittoClientPool::shard(int index) const
+{
+  return d->shards.value(index, 0);
+}
+
+bool QtMosquittoClientPool::isShardConnected(int index) const
+{
+  return d->shardConnected.value(index, false);
+}
+
+int QtMosquittoClientPool::shardForTopic(const QByteArray& topic) const
+{
+  // FNV-1a, unlike qHash it is stable across runs, platforms and Qt versions
+  quint32 hash = 2166136261u;
+  for (int i = 0; i < topic.size(); ++i)
+  {
+    hash ^= static_cast<quint8>(topic.at(i));
+    hash *= 16777619u;
+  }
+  return static_cast<int>(hash % static_cast<quint32>(d->shards.size()));
+}
+
+void QtMosquittoClientPool::setUsernamePassword(const QString& username, const QString& password)
+{
+  foreach (QtMosquittoClient* client, d->shards)
+  {
+    client->setUsernamePassword(username, password);
+  }
+}
+
+bool QtMosquittoClientPool::doConnect(const QString& host, int port, int keepalive)
+{
+  bool ok = true;
+  foreach (QtMosquittoClient* client, d->shards)
+  {
+    if (!client->isConnected() && !client->doConnect(host, port, keepalive))
+    {
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+bool QtMosquittoClientPool::isConnected() const
+{
+  return d->connected;
+}
+
+int QtMosquittoClientPool::publish(const QString& topic, const QByteArray& payload, int qos, bool retain)
+{
+  return publish(QtMosquittoTopic(topic), payload, qos, retain);
+}
+
+int QtMosquittoClientPool::publish(const QtMosquittoTopic& topic, const QByteArray& payload, int qos, bool retain)
+{
+  return d->shards.at(shardForTopic(topic.utf8()))->publish(topic, payload, qos, retain);
+}
+
+bool QtMosquittoClientPool::subscribe(const QString& topic, int qos)
+{
+  return d->shards.at(shardForTopic(topic.toUtf8()))->subscribe(topic, qos);
+}
+
+bool QtMosquittoClientPool::unsubscribe(const QString& topic)
+{
+  return d->shards.at(shardForTopic(topic.toUtf8()))->unsubscribe(topic);
+}
+
+bool QtMosquittoClientPool::doDisconnect()
+{
+  bool ok = true;
+  foreach (QtMosquittoClient* client, d->shards)
+  {
+    if (client->isConnected() && !client->doDisconnect())
+    {
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+void QtMosquittoClientPool::setAutoReconnect(bool reconnect)
+{
+  foreach (QtMosquittoClient* client, d->shards)
+  {
+    client->setAutoReconnect(reconnect);
+  }
+}
+
+int QtMosquittoClientPool::shardIndex(QObject* client) const
+{
+  return d->shards.indexOf(static_cast<QtMosquittoClient*>(client));
+}
+
+void QtMosquittoClientPool::shardConnectState(bool state)
+{
+  const int index = shardIndex(sender());
+  if (index < 0 || d->shardConnected.at(index) == state)
+  {
+    return;
+  }
+  d->shardConnected[index] = state;
+  emit shardStateChanged(index, state);
+
+  const bool all = !d->shardConnected.contains(false);
+  if (all != d->connected)
+  {
+    d->connected = all;
+    if (all)
+    {
+      emit connected();
+    }
+    else
+    {
+      emit disconnected();
+    }
+    emit connectState(all);
+  }
+}
+
+void QtMosquittoClientPool::shardError(QtMosquittoClient::ClientError clientError)
+{
+  const int index = shardIndex(sender());
+  if (index >= 0)
+  {
+    emit error(index, clientError);
+  }
+}
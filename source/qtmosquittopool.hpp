@@ -0,0 +1,132 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#ifndef QTMOSQUITTOPOOL_HPP
+#define QTMOSQUITTOPOOL_HPP
+
+#include "qtmosquitto.hpp"
+
+/** Pool of client connections acting as one logical client.
+ * Each shard is a QtMosquittoClient in ThreadedIo mode, so every connection
+ * has its own socket and network thread. Publishes are routed to a shard by
+ * a stable hash of the topic, which keeps the order of messages on a topic.
+ * Messages received by every shard are merged into messageReceived().
+ */
+class QTMOSQUITTO_EXPORT QtMosquittoClientPool : public QObject
+{
+  Q_OBJECT
+  public:
+    /** Create the pool.
+     * \param shards         Number of connections, at least one.
+     * \param id             Client ID prefix, the shard index is appended to
+     *                           it. If empty random IDs will be generated.
+     * \param clean_session  If true clean sessions will be created, must be
+     *                           true if id is not set.
+     * \param parent         QObject parent.
+     */
+    QtMosquittoClientPool(int shards, const QString& id = QString(), bool clean_session = true, QObject* parent = 0);
+
+    /// Disconnect every shard and release resources.
+    virtual ~QtMosquittoClientPool();
+
+    /// Number of shards in the pool.
+    int shardCount() const;
+
+    /** Get a shard, e.g to configure TLS or read its metrics.
+     * \param index  Shard index, from 0 to shardCount() - 1.
+     */
+    QtMosquittoClient* shard(int index) const;
+
+    /// True if the shard has an established connection.
+    bool isShardConnected(int index) const;
+
+    /// Index of the shard messages on a topic are published by.
+    int shardForTopic(const QByteArray& topic) const;
+
+    /// Set the username and password of every shard.
+    void setUsernamePassword(const QString& username, const QString& password);
+
+    /** Start connecting every shard to the server.
+     * \param host       Host name or IP address of server.
+     * \param port       Port on server running MQTT service.
+     * \param keepalive  Interval between ping messages.
+     * \returns True if every shard is starting to connect, false otherwise.
+     */
+    bool doConnect(const QString& host, int port = 1883, int keepalive = 60);
+
+    /// True when every shard has an established connection.
+    bool isConnected() const;
+
+    /** Publish a message on the shard for its topic.
+     * \returns Message ID of the shard on success or a
+     *          QtMosquittoClient::PublishError on failure.
+     * \sa shardForTopic
+     */
+    int publish(const QString& topic, const QByteArray& payload, int qos = 0, bool retain = false);
+
+    /** Publish a message to a prepared topic on the shard for the topic.
+     * \returns Message ID of the shard on success or a
+     *          QtMosquittoClient::PublishError on failure.
+     */
+    int publish(const QtMosquittoTopic& topic, const QByteArray& payload, int qos = 0, bool retain = false);
+
+    /** Subscribe to messages with the given topic.
+     * The subscription is made by a single shard, chosen by the filter, so
+     * each message is received only once.
+     */
+    bool subscribe(const QString& topic, int qos = 0);
+
+    /// Unsubscribe from messages with the given topic.
+    bool unsubscribe(const QString& topic);
+
+  public slots:
+    /// Disconnect every shard.
+    bool doDisconnect();
+
+    /// Enable automatic reconnect on every shard.
+    void setAutoReconnect(bool reconnect);
+
+  signals:
+    /// Emitted when every shard has connected.
+    void connected();
+
+    /// Emitted when the pool stops being fully connected.
+    void disconnected();
+
+    /// True when every shard is connected, false otherwise.
+    void connectState(bool connected);
+
+    /// Emitted when the connection state of a shard changes.
+    void shardStateChanged(int shard, bool connected);
+
+    /// Emitted when an error occurs on a shard.
+    void error(int shard, QtMosquittoClient::ClientError clientError);
+
+    /// Emitted for messages received by any shard.
+    void messageReceived(const QtMosquittoMessage& message);
+
+  private slots:
+    void shardConnectState(bool state);
+    void shardError(QtMosquittoClient::ClientError clientError);
+
+  private:
+    int shardIndex(QObject* client) const;
+    struct data;
+    data* d;
+    Q_DISABLE_COPY(QtMosquittoClientPool)
+};
+
+#endif
@@ -0,0 +1,625 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#include "qtmosquittorecorder.hpp"
+
+#include <climits>
+#include <cstring>
+
+namespace
+{
+  const char recordingMagic[4] = {'Q', 'M', 'R', 'C'};
+  const quint16 recordingVersion = 1;
+  const int indexInterval = 1024;
+  const int indexEntrySize = 16;
+  // Bytes collected before the writer thread is woken, or every flushInterval ms
+  const int batchBytes = 256 * 1024;
+  const int flushInterval = 100;
+  // Records published per event when replaying faster than recorded
+  const int replayBurst = 1000;
+  // Records due within this many nanoseconds are published in the current event
+  const qint64 replaySlack = 1000000;
+
+  template <typename T>
+  void putLE(uchar* out, T value)
+  {
+    qToLittleEndian<T>(value, out);
+  }
+
+  template <typename T>
+  T getLE(const uchar* in)
+  {
+    return qFromLittleEndian<T>(in);
+  }
+
+  struct Record
+  {
+    qint64 size;
+    qint64 time;
+    int direction;
+    int qos;
+    bool retain;
+    const char* topic;
+    int topicLength;
+    const char* payload;
+    int payloadLength;
+  };
+
+  /// Parse the record at pos, false if it is truncated or past the end.
+  bool readRecord(const uchar* map, qint64 end, qint64 pos, Record& r)
+  {
+    if (pos + QtMosquittoRecorder::RecordHeaderSize > end)
+    {
+      return false;
+    }
+    const uchar* p = map + pos;
+    r.size = getLE<quint32>(p);
+    r.time = getLE<qint64>(p + 4);
+    r.direction = p[12];
+    r.qos = p[13] & 0x03;
+    r.retain = (p[13] & 0x04) != 0;
+    r.topicLength = getLE<quint16>(p + 14);
+    r.payloadLength = static_cast<int>(getLE<quint32>(p + 16));
+    if (r.payloadLength < 0 || pos + r.size > end ||
+        r.size != qint64(QtMosquittoRecorder::RecordHeaderSize) + r.topicLength + r.payloadLength)
+    {
+      return false;
+    }
+    r.topic = reinterpret_cast<const char*>(p + QtMosquittoRecorder::RecordHeaderSize);
+    r.payload = r.topic + r.topicLength;
+    return true;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct QtMosquittoRecorder::data
+{
+  class Writer : public QThread
+  {
+    public:
+      explicit Writer(data* owner):QThread(),mOwner(owner){}
+
+    protected:
+      virtual void run() { mOwner->writeLoop(); }
+
+    private:
+      data* mOwner;
+  };
+
+  QFile file;
+  Writer writer;
+  QMutex mutex;
+  QWaitCondition wake;
+  QByteArray buffer;
+  int maxBuffered;
+  bool open;
+  bool stopping;
+  bool writeFailed;
+  QElapsedTimer clock;
+  // File offset the next record will be written at
+  qint64 offset;
+  QVector<QPair<qint64, qint64> > index;
+  quint64 recorded;
+  quint64 dropped;
+
+  data():file(),writer(this),mutex(),wake(),buffer(),maxBuffered(0),open(false),stopping(false),writeFailed(false),
+    clock(),offset(0),index(),recorded(0),dropped(0){}
+
+  void writeLoop()
+  {
+    QByteArray batch;
+    batch.reserve(batchBytes);
+    bool stop = false;
+    while (!stop)
+    {
+      {
+        QMutexLocker lock(&mutex);
+        if (!stopping && buffer.size() < batchBytes)
+        {
+          wake.wait(&mutex, flushInterval);
+        }
+        // The emptied batch keeps its capacity and becomes the next buffer
+        batch.swap(buffer);
+        stop = stopping;
+      }
+      if (!batch.isEmpty())
+      {
+        if (file.write(batch) != batch.size() && !writeFailed)
+        {
+          qWarning() << "QtMosquittoRecorder: Failed to write recording:" << file.errorString();
+          writeFailed = true;
+        }
+        batch.resize(0);
+      }
+    }
+  }
+};
+
+
+QtMosquittoRecorder::QtMosquittoRecorder() :
+  d(new data())
+{
+}
+
+QtMosquittoRecorder::~QtMosquittoRecorder()
+{
+  close();
+  delete d;
+  d = 0;
+}
+
+bool QtMosquittoRecorder::open(const QString& fileName, int maxBuffered)
+{
+  if (isOpen())
+  {
+    qWarning() << "QtMosquittoRecorder::open: Already open";
+    return false;
+  }
+  d->file.setFileName(fileName);
+  if (!d->file.open(QIODevice::ReadWrite | QIODevice::Truncate))
+  {
+    qWarning() << "QtMosquittoRecorder::open: Failed to open" << fileName << d->file.errorString();
+    return false;
+  }
+
+  // The index offset stays 0 until close(), marking an unfinished recording
+  uchar header[FileHeaderSize];
+  memset(header, 0, sizeof(header));
+  memcpy(header, recordingMagic, sizeof(recordingMagic));
+  putLE<quint16>(header + 4, recordingVersion);
+  putLE<qint64>(header + 8, QDateTime::currentMSecsSinceEpoch());
+  if (d->file.write(reinterpret_cast<const char*>(header), FileHeaderSize) != FileHeaderSize)
+  {
+    qWarning() << "QtMosquittoRecorder::open: Failed to write header" << d->file.errorString();
+    d->file.close();
+    return false;
+  }
+
+  QMutexLocker lock(&d->mutex);
+  d->maxBuffered = qMax(batchBytes, maxBuffered);
+  d->buffer.clear();
+  d->buffer.reserve(batchBytes);
+  d->stopping = false;
+  d->writeFailed = false;
+  d->offset = FileHeaderSize;
+  d->index.clear();
+  d->recorded = 0;
+  d->dropped = 0;
+  d->clock.start();
+  d->open = true;
+  d->writer.start(QThread::LowPriority);
+  return true;
+}
+
+void QtMosquittoRecorder::close()
+{
+  {
+    QMutexLocker lock(&d->mutex);
+    if (!d->open)
+    {
+      return;
+    }
+    d->open = false;
+    d->stopping = true;
+    d->wake.wakeOne();
+  }
+  d->writer.wait();
+
+  const qint64 indexOffset = d->offset;
+  QByteArray index(d->index.size() * indexEntrySize, Qt::Uninitialized);
+  uchar* out = reinterpret_cast<uchar*>(index.data());
+  for (int i = 0; i < d->index.size(); ++i, out += indexEntrySize)
+  {
+    putLE<qint64>(out, d->index.at(i).first);
+    putLE<qint64>(out + 8, d->index.at(i).second);
+  }
+  uchar tail[16];
+  putLE<qint64>(tail, indexOffset);
+  putLE<quint64>(tail + 8, d->recorded);
+  if (d->file.write(index) != index.size() || !d->file.seek(16) ||
+      d->file.write(reinterpret_cast<const char*>(tail), sizeof(tail)) != qint64(sizeof(tail)))
+  {
+    qWarning() << "QtMosquittoRecorder::close: Failed to write index" << d->file.errorString();
+  }
+  d->file.close();
+}
+
+bool QtMosquittoRecorder::isOpen() const
+{
+  QMutexLocker lock(&d->mutex);
+  return d->open;
+}
+
+void QtMosquittoRecorder::record(Direction direction, const QByteArray& topic, const QByteArray& payload, int qos, bool retain)
+{
+  const int size = RecordHeaderSize + topic.size() + payload.size();
+  uchar header[RecordHeaderSize];
+  putLE<quint32>(header, static_cast<quint32>(size));
+  header[12] = static_cast<uchar>(direction);
+  header[13] = static_cast<uchar>((qos & 0x03) | (retain ? 0x04 : 0));
+  putLE<quint16>(header + 14, static_cast<quint16>(topic.size()));
+  putLE<quint32>(header + 16, static_cast<quint32>(payload.size()));
+
+  QMutexLocker lock(&d->mutex);
+  if (!d->open)
+  {
+    return;
+  }
+  if (d->buffer.size() + size > d->maxBuffered)
+  {
+    ++d->dropped;
+    return;
+  }
+  // Stamped under the lock so times never go backwards in the file
+  const qint64 time = d->clock.nsecsElapsed();
+  putLE<qint64>(header + 4, time);
+  if (d->recorded % indexInterval == 0)
+  {
+    d->index.append(qMakePair(time, d->offset));
+  }
+  d->buffer.append(reinterpret_cast<const char*>(header), RecordHeaderSize);
+  d->buffer.append(topic);
+  d->buffer.append(payload);
+  d->offset += size;
+  ++d->recorded;
+  if (d->buffer.size() >= batchBytes)
+  {
+    d->wake.wakeOne();
+  }
+}
+
+quint64 QtMosquittoRecorder::recorded() const
+{
+  QMutexLocker lock(&d->mutex);
+  return d->recorded;
+}
+
+quint64 QtMosquittoRecorder::dropped() const
+{
+  QMutexLocker lock(&d->mutex);
+  return d->dropped;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct QtMosquittoReplayer::data
+{
+  QFile file;
+  uchar* map;
+  qint64 end;
+  qint64 pos;
+  qint64 recordCount;
+  QVector<QPair<qint64, qint64> > index;
+  double speed;
+  QtMosquittoRecorder::Direction direction;
+  QPointer<QtMosquittoClient> client;
+  QTimer timer;
+  QElapsedTimer clock;
+  qint64 baseTime;
+  bool running;
+  // The client refused a message with PublishBackpressure, it is retried once the client has room
+  bool paused;
+  quint64 replayed;
+  quint64 failed;
+  QHash<QByteArray, QtMosquittoTopic> topics;
+
+  data():file(),map(0),end(0),pos(0),recordCount(-1),index(),speed(1.0),direction(QtMosquittoRecorder::Inbound),
+    client(),timer(),clock(),baseTime(0),running(false),paused(false),replayed(0),failed(0),topics(){}
+};
+
+
+QtMosquittoReplayer::QtMosquittoReplayer(QObject* par) :
+  QObject(par),
+  d(new data())
+{
+  d->timer.setSingleShot(true);
+  d->timer.setTimerType(Qt::PreciseTimer);
+  connect(&d->timer, SIGNAL(timeout()), this, SLOT(replayTimeout()));
+}
+
+QtMosquittoReplayer::~QtMosquittoReplayer()
+{
+  close();
+  delete d;
+  d = 0;
+}
+
+bool QtMosquittoReplayer::open(const QString& fileName)
+{
+  close();
+  d->file.setFileName(fileName);
+  if (!d->file.open(QIODevice::ReadOnly))
+  {
+    qWarning() << "QtMosquittoReplayer::open: Failed to open" << fileName << d->file.errorString();
+    return false;
+  }
+  const qint64 size = d->file.size();
+  d->map = (size >= QtMosquittoRecorder::FileHeaderSize) ? d->file.map(0, size) : 0;
+  if (!d->map || memcmp(d->map, recordingMagic, sizeof(recordingMagic)) != 0 ||
+      getLE<quint16>(d->map + 4) != recordingVersion)
+  {
+    qWarning() << "QtMosquittoReplayer::open: Not a recording:" << fileName;
+    close();
+    return false;
+  }
+
+  const qint64 indexOffset = getLE<qint64>(d->map + 16);
+  if (indexOffset >= QtMosquittoRecorder::FileHeaderSize && indexOffset <= size &&
+      (size - indexOffset) % indexEntrySize == 0)
+  {
+    d->end = indexOffset;
+    d->recordCount = static_cast<qint64>(getLE<quint64>(d->map + 24));
+    for (qint64 entry = indexOffset; entry < size; entry += indexEntrySize)
+    {
+      d->index.append(qMakePair(getLE<qint64>(d->map + entry), getLE<qint64>(d->map + entry + 8)));
+    }
+  }
+  else
+  {
+    // Unfinished recording, readRecord() stops at the first truncated record
+    d->end = size;
+    d->recordCount = -1;
+  }
+  d->pos = QtMosquittoRecorder::FileHeaderSize;
+  return true;
+}
+
+void QtMosquittoReplayer::close()
+{
+  stop();
+  if (d->map)
+  {
+    d->file.unmap(d->map);
+    d->map = 0;
+  }
+  d->file.close();
+  d->end = 0;
+  d->pos = 0;
+  d->recordCount = -1;
+  d->index.clear();
+  d->topics.clear();
+}
+
+bool QtMosquittoReplayer::isOpen() const
+{
+  return d->map != 0;
+}
+
+qint64 QtMosquittoReplayer::recordCount() const
+{
+  return d->recordCount;
+}
+
+void QtMosquittoReplayer::setSpeed(double speed)
+{
+  d->speed = qMax(0.0, speed);
+  if (d->running)
+  {
+    // Keep the current position as the reference for the new pace
+    Record r;
+    if (readRecord(d->map, d->end, d->pos, r))
+    {
+      d->baseTime = r.time;
+      d->clock.restart();
+    }
+  }
+}
+
+double QtMosquittoReplayer::speed() const
+{
+  return d->speed;
+}
+
+void QtMosquittoReplayer::setDirection(QtMosquittoRecorder::Direction direction)
+{
+  d->direction = direction;
+}
+
+bool QtMosquittoReplayer::seek(qint64 msecs)
+{
+  if (!d->map)
+  {
+    return false;
+  }
+  const qint64 target = msecs * 1000000;
+  qint64 pos = QtMosquittoRecorder::FileHeaderSize;
+  // Start from the last indexed record before the target
+  int lo = 0;
+  int hi = d->index.size();
+  while (lo < hi)
+  {
+    const int mid = (lo + hi) / 2;
+    if (d->index.at(mid).first <= target)
+    {
+      pos = d->index.at(mid).second;
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  Record r;
+  while (readRecord(d->map, d->end, pos, r))
+  {
+    if (r.time >= target)
+    {
+      d->pos = pos;
+      if (d->running)
+      {
+        d->baseTime = r.time;
+        d->clock.restart();
+      }
+      return true;
+    }
+    pos += r.size;
+  }
+  return false;
+}
+
+bool QtMosquittoReplayer::start(QtMosquittoClient* client)
+{
+  if (!d->map || !client)
+  {
+    qWarning() << "QtMosquittoReplayer::start: No recording or client";
+    return false;
+  }
+  Record r;
+  if (!readRecord(d->map, d->end, d->pos, r))
+  {
+    qWarning() << "QtMosquittoReplayer::start: No records left";
+    return false;
+  }
+  d->client = client;
+  d->baseTime = r.time;
+  d->clock.start();
+  d->replayed = 0;
+  d->failed = 0;
+  d->running = true;
+  d->paused = false;
+  connect(client, SIGNAL(backpressure(bool)), this, SLOT(clientBackpressure(bool)), Qt::UniqueConnection);
+  connect(client, SIGNAL(published(int)), this, SLOT(clientPublished()), Qt::UniqueConnection);
+  d->timer.start(0);
+  return true;
+}
+
+bool QtMosquittoReplayer::isRunning() const
+{
+  return d->running;
+}
+
+quint64 QtMosquittoReplayer::replayed() const
+{
+  return d->replayed;
+}
+
+quint64 QtMosquittoReplayer::failed() const
+{
+  return d->failed;
+}
+
+void QtMosquittoReplayer::stop()
+{
+  d->running = false;
+  d->paused = false;
+  d->timer.stop();
+  if (d->client)
+  {
+    disconnect(d->client, 0, this, 0);
+  }
+}
+
+void QtMosquittoReplayer::clientBackpressure(bool active)
+{
+  if (!active)
+  {
+    resume();
+  }
+}
+
+void QtMosquittoReplayer::clientPublished()
+{
+  // A full priority lane has room again once any message is published
+  resume();
+}
+
+void QtMosquittoReplayer::resume()
+{
+  if (!d->running || !d->paused)
+  {
+    return;
+  }
+  d->paused = false;
+  // Keep the pace from the refused record on instead of catching up in one burst
+  Record r;
+  if (readRecord(d->map, d->end, d->pos, r))
+  {
+    d->baseTime = r.time;
+    d->clock.restart();
+  }
+  d->timer.start(0);
+}
+
+void QtMosquittoReplayer::replayTimeout()
+{
+  if (!d->running || !d->client)
+  {
+    stop();
+    return;
+  }
+  if (d->paused)
+  {
+    return;
+  }
+
+  const qint64 now = d->clock.nsecsElapsed();
+  int burst = 0;
+  Record r;
+  while (readRecord(d->map, d->end, d->pos, r))
+  {
+    if (d->speed > 0)
+    {
+      const qint64 due = static_cast<qint64>((r.time - d->baseTime) / d->speed);
+      if (due - now >= replaySlack)
+      {
+        d->timer.start(static_cast<int>(qMin<qint64>((due - now) / 1000000, INT_MAX)));
+        return;
+      }
+    }
+    if (burst == replayBurst)
+    {
+      // Let the client write and read between bursts
+      d->timer.start(0);
+      return;
+    }
+    if (r.direction != d->direction)
+    {
+      d->pos += r.size;
+      continue;
+    }
+
+    const QByteArray topicName(QByteArray::fromRawData(r.topic, r.topicLength));
+    QHash<QByteArray, QtMosquittoTopic>::const_iterator topic = d->topics.constFind(topicName);
+    if (topic == d->topics.constEnd())
+    {
+      const QByteArray key(r.topic, r.topicLength);
+      topic = d->topics.insert(key, QtMosquittoTopic(key));
+    }
+    // Copied, the client may keep the payload after the file is unmapped
+    const int mid = d->client->publish(topic.value(), QByteArray(r.payload, r.payloadLength), r.qos, r.retain);
+    if (mid == QtMosquittoClient::PublishBackpressure)
+    {
+      // Retried from the same record once the client has room
+      d->paused = true;
+      return;
+    }
+    if (mid < 0)
+    {
+      ++d->failed;
+    }
+    else
+    {
+      ++d->replayed;
+    }
+    d->pos += r.size;
+    ++burst;
+  }
+
+  stop();
+  emit finished();
+}
@@ -0,0 +1,180 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#ifndef QTMOSQUITTORECORDER_HPP
+#define QTMOSQUITTORECORDER_HPP
+
+#include "qtmosquitto.hpp"
+
+/** Capture of the messages received and published by a client.
+ * The file starts with a 32 byte header, the bytes 'Q' 'M' 'R' 'C', the
+ * format version, the wall clock start time, the offset of the index and the
+ * number of records. Each record is a 20 byte header, holding its size, the
+ * nanoseconds since the start of the recording, the direction, QoS, retain
+ * flag, topic and payload sizes, followed by the topic and the payload. The
+ * index at the end holds the time and offset of every 1024th record. All
+ * integers are little endian.
+ * record() only copies the message into a memory buffer, a background thread
+ * writes the buffer to the file in batches. When the thread falls behind and
+ * the buffer is full messages are dropped rather than slowing the caller.
+ * \sa QtMosquittoClient::setRecorder, QtMosquittoReplayer
+ */
+class QTMOSQUITTO_EXPORT QtMosquittoRecorder
+{
+  public:
+    /// Direction of a recorded message.
+    enum Direction
+    {
+      Inbound = 0,  ///< Received from the server.
+      Outbound = 1  ///< Published by the client.
+    };
+
+    /// Size of the file header.
+    enum { FileHeaderSize = 32 };
+
+    /// Size of the header in front of every record.
+    enum { RecordHeaderSize = 20 };
+
+    /// Create a closed recorder.
+    QtMosquittoRecorder();
+
+    /// Close the recorder.
+    ~QtMosquittoRecorder();
+
+    /** Create a recording file, replacing any existing file.
+     * \param fileName     Path of the recording.
+     * \param maxBuffered  Most bytes held in memory waiting to be written.
+     * \returns True if the recording started, false otherwise.
+     */
+    bool open(const QString& fileName, int maxBuffered = 64 * 1024 * 1024);
+
+    /// Write every buffered record and the index, then close the file.
+    void close();
+
+    /// True if the recording file is open.
+    bool isOpen() const;
+
+    /** Record a message, may be called from any thread.
+     * \param direction  Whether the message was received or published.
+     * \param topic      UTF-8 encoded topic.
+     * \param payload    Message payload.
+     * \param qos        Message QoS level.
+     * \param retain     Retain flag of the message.
+     */
+    void record(Direction direction, const QByteArray& topic, const QByteArray& payload, int qos, bool retain);
+
+    /// Number of messages recorded.
+    quint64 recorded() const;
+
+    /// Number of messages dropped because the buffer was full.
+    quint64 dropped() const;
+
+  private:
+    struct data;
+    data* d;
+    Q_DISABLE_COPY(QtMosquittoRecorder)
+};
+
+
+/** Publish the messages of a recording through a client.
+ * Records are read from the memory mapped file and published in the order
+ * they were recorded, so the order of messages on each topic is kept. The
+ * gaps between messages are kept as well, scaled by the speed, messages due
+ * within a millisecond of each other are published together. A message the
+ * client refuses with PublishBackpressure pauses the replay until the client
+ * releases backpressure or publishes a message, other failures are counted
+ * and skipped.
+ */
+class QTMOSQUITTO_EXPORT QtMosquittoReplayer : public QObject
+{
+  Q_OBJECT
+  public:
+    /// Create a replayer without a recording.
+    QtMosquittoReplayer(QObject* parent = 0);
+
+    /// Stop and close the recording.
+    virtual ~QtMosquittoReplayer();
+
+    /** Open and map a recording.
+     * A recording that was not closed, e.g after a crash, is replayed up to
+     * its last complete record.
+     * \returns True if the recording is ready to replay, false otherwise.
+     */
+    bool open(const QString& fileName);
+
+    /// Stop and unmap the recording.
+    void close();
+
+    /// True if a recording is open.
+    bool isOpen() const;
+
+    /// Number of records in the recording, or -1 if it was not closed.
+    qint64 recordCount() const;
+
+    /** Set the replay speed.
+     * \param speed  1 for the recorded pace, 2 for twice as fast and so on, 0
+     *               to publish as fast as the client accepts.
+     */
+    void setSpeed(double speed);
+
+    /// Replay speed.
+    double speed() const;
+
+    /// Replay only messages recorded in this direction, Inbound by default.
+    void setDirection(QtMosquittoRecorder::Direction direction);
+
+    /** Move to the first record at or after a time.
+     * \param msecs  Milliseconds since the start of the recording.
+     * \returns True if a record was found, false otherwise.
+     */
+    bool seek(qint64 msecs);
+
+    /** Start publishing from the current position.
+     * \param client  Client to publish with, must outlive the replay.
+     * \returns True if the replay started, false otherwise.
+     */
+    bool start(QtMosquittoClient* client);
+
+    /// True while replaying.
+    bool isRunning() const;
+
+    /// Number of messages published since the last start().
+    quint64 replayed() const;
+
+    /// Number of messages the client failed to publish since the last start().
+    quint64 failed() const;
+
+  public slots:
+    /// Pause the replay, start() continues from the current position.
+    void stop();
+
+  signals:
+    /// Emitted when every record has been replayed.
+    void finished();
+
+  private slots:
+    void replayTimeout();
+    void clientBackpressure(bool active);
+    void clientPublished();
+
+  private:
+    void resume();
+    struct data;
+    data* d;
+    Q_DISABLE_COPY(QtMosquittoReplayer)
+};
+
+#endif
@@ -0,0 +1,493 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#include "qtmosquittospool.hpp"
+
+#include <cstring>
+
+namespace
+{
+  // File layout, all integers are little endian:
+  //   two 64 byte header slots, the one with the highest valid sequence wins
+  //     magic[8] sequence:u64 capacity:u64 head:u64 tail:u64 count:u64 crc:u32
+  //   capacity bytes of records, each
+  //     magic:u32 length:u32 crc:u32 qos:u8 retain:u8 topicLength:u16 topic payload
+  //   a wrap marker in place of a record means the next record is at offset 0.
+  //   a skip record, magic:u32 length:u32, covers length bytes of damaged
+  //   records dropped by recovery, it is not counted as a message.
+  const char spoolMagic[8] = { 'Q', 'M', 'S', 'P', 'O', 'O', 'L', '1' };
+  const quint32 recordMagic = 0x52505351;  // "QSPR"
+  const quint32 wrapMagic = 0x57505351;    // "QSPW"
+  const quint32 skipMagic = 0x4B505351;    // "QSPK"
+  const qint64 headerSlotSize = 64;
+  const qint64 headerCrcOffset = 48;
+  const qint64 dataOffset = 2 * headerSlotSize;
+  const qint64 recordHeaderSize = 12;
+  const qint64 recordFixedSize = 4;
+
+  struct Crc32Table
+  {
+    quint32 entries[256];
+
+    Crc32Table()
+    {
+      for (quint32 i = 0; i < 256; ++i)
+      {
+        quint32 c = i;
+        for (int k = 0; k < 8; ++k)
+        {
+          c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        }
+        entries[i] = c;
+      }
+    }
+  };
+
+  quint32 crc32(const uchar* data, qint64 size)
+  {
+    static const Crc32Table table;
+    quint32 c = 0xFFFFFFFFu;
+    for (qint64 i = 0; i < size; ++i)
+    {
+      c = table.entries[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct QtMosquittoSpool::data
+{
+  QFile file;
+  uchar* map;
+  qint64 capacity;
+  qint64 head;
+  qint64 tail;
+  qint64 count;
+  quint64 sequence;
+  OverflowPolicy policy;
+  quint64 dropped;
+
+  data():file(),map(0),capacity(0),head(0),tail(0),count(0),sequence(0),policy(DropOldest),dropped(0){}
+
+  uchar* region() const { return map + dataOffset; }
+
+  void writeHeader()
+  {
+    ++sequence;
+    uchar* slot = map + (sequence % 2) * headerSlotSize;
+    memcpy(slot, spoolMagic, sizeof(spoolMagic));
+    qToLittleEndian<quint64>(sequence, slot + 8);
+    qToLittleEndian<quint64>(capacity, slot + 16);
+    qToLittleEndian<quint64>(head, slot + 24);
+    qToLittleEndian<quint64>(tail, slot + 32);
+    qToLittleEndian<quint64>(count, slot + 40);
+    qToLittleEndian<quint32>(crc32(slot, headerCrcOffset), slot + headerCrcOffset);
+  }
+
+  bool readHeader(qint64 fileCapacity)
+  {
+    bool found = false;
+    for (int i = 0; i < 2; ++i)
+    {
+      const uchar* slot = map + i * headerSlotSize;
+      if (memcmp(slot, spoolMagic, sizeof(spoolMagic)) != 0 ||
+          qFromLittleEndian<quint32>(slot + headerCrcOffset) != crc32(slot, headerCrcOffset))
+      {
+        continue;
+      }
+      const quint64 slotSequence = qFromLittleEndian<quint64>(slot + 8);
+      const qint64 slotCapacity = qFromLittleEndian<quint64>(slot + 16);
+      const qint64 slotHead = qFromLittleEndian<quint64>(slot + 24);
+      const qint64 slotTail = qFromLittleEndian<quint64>(slot + 32);
+      if (slotCapacity != fileCapacity || slotHead > slotCapacity || slotTail > slotCapacity ||
+          (found && slotSequence < sequence))
+      {
+        continue;
+      }
+      found = true;
+      sequence = slotSequence;
+      capacity = slotCapacity;
+      head = slotHead;
+      tail = slotTail;
+      count = qFromLittleEndian<quint64>(slot + 40);
+    }
+    return found;
+  }
+
+  /// Position of the record to read at pos, following a wrap and skipping skip records.
+  qint64 locate(qint64 pos) const
+  {
+    for (;;)
+    {
+      if (capacity - pos < recordHeaderSize)
+      {
+        pos = 0;
+        continue;
+      }
+      const quint32 magic = qFromLittleEndian<quint32>(region() + pos);
+      if (magic == wrapMagic && pos != 0)
+      {
+        pos = 0;
+      }
+      else if (magic == skipMagic)
+      {
+        pos += recordHeaderSize + qFromLittleEndian<quint32>(region() + pos + 4);
+      }
+      else
+      {
+        return pos;
+      }
+    }
+  }
+
+  /// Cover size bytes at pos, from a damaged record up to the next good one, with a skip record.
+  void writeSkip(qint64 pos, qint64 size)
+  {
+    qToLittleEndian<quint32>(skipMagic, region() + pos);
+    qToLittleEndian<quint32>(static_cast<quint32>(size - recordHeaderSize), region() + pos + 4);
+  }
+
+  /// First valid record starting in (from, end) that also ends before end, or -1.
+  qint64 findRecord(qint64 from, qint64 end) const
+  {
+    for (qint64 pos = from; pos + recordHeaderSize + recordFixedSize <= end; ++pos)
+    {
+      quint32 length = 0;
+      if (qFromLittleEndian<quint32>(region() + pos) == recordMagic && validRecord(pos, length) &&
+          pos + recordHeaderSize + length <= end)
+      {
+        return pos;
+      }
+    }
+    return -1;
+  }
+
+  bool validRecord(qint64 pos, quint32& length) const
+  {
+    if (capacity - pos < recordHeaderSize + recordFixedSize)
+    {
+      return false;
+    }
+    const uchar* p = region() + pos;
+    length = qFromLittleEndian<quint32>(p + 4);
+    return qFromLittleEndian<quint32>(p) == recordMagic &&
+           length >= recordFixedSize &&
+           length <= capacity - pos - recordHeaderSize &&
+           qFromLittleEndian<quint16>(p + recordHeaderSize + 2) <= length - recordFixedSize &&
+           qFromLittleEndian<quint32>(p + 8) == crc32(p + recordHeaderSize, length);
+  }
+
+  /** Drop records that do not check out, e.g after a crash mid-write.
+   * Records are walked from tail to head, a damaged record is covered with a
+   * skip record up to the next valid one, so only the damaged messages are
+   * lost and not everything queued behind them.
+   */
+  void recover()
+  {
+    qint64 valid = 0;
+    qint64 pos = tail;
+    // Records at or after tail run to the end of the file when head wrapped
+    bool wrapped = (count == 0) || (head > tail);
+    while (count > 0 && pos != head)
+    {
+      const qint64 at = locate(pos);
+      if (at < pos)
+      {
+        wrapped = true;
+      }
+      if (at == head)
+      {
+        break;
+      }
+      const qint64 end = wrapped ? head : capacity;
+      quint32 length = 0;
+      if (validRecord(at, length) && at + recordHeaderSize + length <= end)
+      {
+        ++valid;
+        pos = at + recordHeaderSize + length;
+        continue;
+      }
+
+      qint64 next = findRecord(at + recordHeaderSize, end);
+      if (next >= 0)
+      {
+        writeSkip(at, next - at);
+        pos = next;
+        continue;
+      }
+      if (!wrapped)
+      {
+        // Nothing usable before the end of the file, carry on from offset 0
+        next = (validRecord(0, length) && recordHeaderSize + length <= head) ? 0 : findRecord(recordHeaderSize, head);
+        if (next >= 0)
+        {
+          if (capacity - at >= 4)
+          {
+            qToLittleEndian<quint32>(wrapMagic, region() + at);
+          }
+          if (next > 0)
+          {
+            writeSkip(0, next);
+          }
+          wrapped = true;
+          pos = next;
+          continue;
+        }
+      }
+      // No valid record before head, the rest is lost
+      head = at;
+      break;
+    }
+    if (valid != count)
+    {
+      qWarning() << "QtMosquittoSpool::open: Recovered" << valid << "of" << count << "messages";
+      count = valid;
+    }
+    if (count == 0)
+    {
+      head = tail = 0;
+    }
+    writeHeader();
+  }
+
+  /// Position a record of size bytes can be written at, or -1 if full.
+  qint64 freePosition(qint64 size) const
+  {
+    if (count == 0)
+    {
+      return 0;
+    }
+    if (head > tail)
+    {
+      if (size <= capacity - head)
+      {
+        return head;
+      }
+      // Wrap, head must never catch up with tail
+      return (size < tail) ? 0 : -1;
+    }
+    return (head + size < tail) ? head : -1;
+  }
+
+  void popRecord()
+  {
+    if (count == 0)
+    {
+      return;
+    }
+    tail = locate(tail);
+    tail += recordHeaderSize + qFromLittleEndian<quint32>(region() + tail + 4);
+    --count;
+    if (count == 0)
+    {
+      head = tail = 0;
+    }
+  }
+};
+
+
+QtMosquittoSpool::QtMosquittoSpool() :
+  d(new data())
+{
+}
+
+QtMosquittoSpool::~QtMosquittoSpool()
+{
+  close();
+  delete d;
+  d = 0;
+}
+
+bool QtMosquittoSpool::open(const QString& fileName, qint64 capacity)
+{
+  close();
+  d->file.setFileName(fileName);
+  if (!d->file.open(QIODevice::ReadWrite))
+  {
+    qWarning() << "QtMosquittoSpool::open: Failed to open" << fileName << d->file.errorString();
+    return false;
+  }
+
+  const qint64 existing = d->file.size();
+  if (existing > dataOffset)
+  {
+    d->map = d->file.map(0, existing);
+    if (d->map && d->readHeader(existing - dataOffset))
+    {
+      d->recover();
+      return true;
+    }
+    qWarning() << "QtMosquittoSpool::open: No valid header, reinitialising" << fileName;
+    if (d->map)
+    {
+      d->file.unmap(d->map);
+      d->map = 0;
+    }
+  }
+
+  if (capacity < recordHeaderSize + recordFixedSize || !d->file.resize(dataOffset + capacity))
+  {
+    qWarning() << "QtMosquittoSpool::open: Failed to size" << fileName << capacity;
+    d->file.close();
+    return false;
+  }
+  d->map = d->file.map(0, dataOffset + capacity);
+  if (!d->map)
+  {
+    qWarning() << "QtMosquittoSpool::open: Failed to map" << fileName << d->file.errorString();
+    d->file.close();
+    return false;
+  }
+  memset(d->map, 0, dataOffset);
+  d->capacity = capacity;
+  d->head = d->tail = d->count = 0;
+  d->sequence = 0;
+  d->writeHeader();
+  return true;
+}
+
+void QtMosquittoSpool::close()
+{
+  if (d->map)
+  {
+    d->file.unmap(d->map);
+    d->map = 0;
+  }
+  d->file.close();
+}
+
+bool QtMosquittoSpool::isOpen() const
+{
+  return d->map != 0;
+}
+
+void QtMosquittoSpool::setOverflowPolicy(OverflowPolicy policy)
+{
+  d->policy = policy;
+}
+
+QtMosquittoSpool::OverflowPolicy QtMosquittoSpool::overflowPolicy() const
+{
+  return d->policy;
+}
+
+bool QtMosquittoSpool::append(const QByteArray& topic, const QByteArray& payload, int qos, bool retain)
+{
+  if (!d->map)
+  {
+    return false;
+  }
+  const qint64 length = recordFixedSize + topic.size() + payload.size();
+  const qint64 size = recordHeaderSize + length;
+  if (size > d->capacity || topic.size() > 0xFFFF)
+  {
+    ++d->dropped;
+    return false;
+  }
+
+  qint64 pos;
+  bool popped = false;
+  while ((pos = d->freePosition(size)) < 0)
+  {
+    if (d->policy == DropNewest)
+    {
+      ++d->dropped;
+      return false;
+    }
+    d->popRecord();
+    ++d->dropped;
+    popped = true;
+  }
+  if (d->count == 0)
+  {
+    d->head = d->tail = 0;
+  }
+  if (pos == 0 && d->head != 0 && d->capacity - d->head >= 4)
+  {
+    qToLittleEndian<quint32>(wrapMagic, d->region() + d->head);
+  }
+  if (popped)
+  {
+    // Release the dropped records on disk before their bytes are reused,
+    // otherwise a crash mid-write leaves the header pointing at a torn record
+    d->writeHeader();
+  }
+
+  uchar* p = d->region() + pos;
+  uchar* body = p + recordHeaderSize;
+  body[0] = static_cast<uchar>(qos);
+  body[1] = retain ? 1 : 0;
+  qToLittleEndian<quint16>(static_cast<quint16>(topic.size()), body + 2);
+  memcpy(body + recordFixedSize, topic.constData(), topic.size());
+  memcpy(body + recordFixedSize + topic.size(), payload.constData(), payload.size());
+  qToLittleEndian<quint32>(recordMagic, p);
+  qToLittleEndian<quint32>(static_cast<quint32>(length), p + 4);
+  qToLittleEndian<quint32>(crc32(body, length), p + 8);
+
+  // The record only becomes visible once the header has been updated
+  d->head = pos + size;
+  ++d->count;
+  d->writeHeader();
+  return true;
+}
+
+QtMosquittoMessage QtMosquittoSpool::peek() const
+{
+  if (d->count == 0)
+  {
+    return QtMosquittoMessage();
+  }
+  const uchar* p = d->region() + d->locate(d->tail);
+  const qint64 length = qFromLittleEndian<quint32>(p + 4);
+  const uchar* body = p + recordHeaderSize;
+  const int topicLength = qFromLittleEndian<quint16>(body + 2);
+  const char* topic = reinterpret_cast<const char*>(body + recordFixedSize);
+  return QtMosquittoMessage(QByteArray(topic, topicLength),
+                            QByteArray(topic + topicLength, length - recordFixedSize - topicLength),
+                            body[0], body[1] != 0);
+}
+
+void QtMosquittoSpool::pop()
+{
+  if (d->count == 0)
+  {
+    return;
+  }
+  d->popRecord();
+  d->writeHeader();
+}
+
+bool QtMosquittoSpool::isEmpty() const
+{
+  return d->count == 0;
+}
+
+qint64 QtMosquittoSpool::count() const
+{
+  return d->count;
+}
+
+qint64 QtMosquittoSpool::capacity() const
+{
+  return d->capacity;
+}
+
+quint64 QtMosquittoSpool::dropped() const
+{
+  return d->dropped;
+}
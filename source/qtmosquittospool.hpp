@@ -0,0 +1,101 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#ifndef QTMOSQUITTOSPOOL_HPP
+#define QTMOSQUITTOSPOOL_HPP
+
+#include "qtmosquitto.hpp"
+
+/** Persistent FIFO of messages waiting to be published.
+ * Messages are kept in a fixed size, memory mapped ring file. Each record is
+ * framed with a length and CRC-32, and the read and write positions are kept
+ * in two alternating header slots, so a spool left behind by a crashed
+ * process is recovered to its last consistent state when it is reopened.
+ * Damaged records found on recovery are skipped, the records behind them are
+ * kept.
+ * \sa QtMosquittoClient::setSpool
+ */
+class QTMOSQUITTO_EXPORT QtMosquittoSpool
+{
+  public:
+    /// What append() does when the spool is full.
+    enum OverflowPolicy
+    {
+      DropOldest, ///< Discard the oldest messages to make room (default).
+      DropNewest  ///< Refuse the new message.
+    };
+
+    /// Create a closed spool.
+    QtMosquittoSpool();
+
+    /// Close the spool.
+    ~QtMosquittoSpool();
+
+    /** Open or create a spool file.
+     * An existing spool is recovered and keeps its capacity, otherwise the
+     * file is created with the given capacity.
+     * \param fileName  Path of the spool file.
+     * \param capacity  Bytes available for records in a new file.
+     * \returns True if the spool is ready for use, false otherwise.
+     */
+    bool open(const QString& fileName, qint64 capacity = 16 * 1024 * 1024);
+
+    /// Unmap and close the spool file, the contents are kept.
+    void close();
+
+    /// True if the spool file is open.
+    bool isOpen() const;
+
+    /// Set the policy applied when the spool is full.
+    void setOverflowPolicy(OverflowPolicy policy);
+
+    /// Policy applied when the spool is full.
+    OverflowPolicy overflowPolicy() const;
+
+    /** Append a message.
+     * \returns True if the message was stored, false if the spool is closed,
+     *          the message can never fit or the spool is full and the policy
+     *          is DropNewest.
+     */
+    bool append(const QByteArray& topic, const QByteArray& payload, int qos, bool retain);
+
+    /** Get the oldest message without removing it.
+     * \returns Oldest message, or a null message if the spool is empty.
+     */
+    QtMosquittoMessage peek() const;
+
+    /// Remove the oldest message.
+    void pop();
+
+    /// True if the spool holds no messages.
+    bool isEmpty() const;
+
+    /// Number of messages in the spool.
+    qint64 count() const;
+
+    /// Bytes available for records.
+    qint64 capacity() const;
+
+    /// Number of messages discarded or refused because the spool was full.
+    quint64 dropped() const;
+
+  private:
+    struct data;
+    data* d;
+    Q_DISABLE_COPY(QtMosquittoSpool)
+};
+
+#endif
@@ -0,0 +1,526 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#include "qtmosquittostream.hpp"
+#include "qtmosquittospool.hpp"
+
+#include <zlib.h>
+
+#include <random>
+
+namespace
+{
+  const char streamVersion = 1;
+  const int manifestSize = QtMosquittoStreamSender::HeaderSize + 12;
+  const int chunkHeaderSize = QtMosquittoStreamSender::HeaderSize + 4;
+  const int digestSize = 32;
+  const int endMessageSize = QtMosquittoStreamSender::HeaderSize + 8 + digestSize;
+
+  void appendBE32(QByteArray& out, quint32 value)
+  {
+    uchar buf[4];
+    qToBigEndian<quint32>(value, buf);
+    out.append(reinterpret_cast<const char*>(buf), 4);
+  }
+
+  void appendBE64(QByteArray& out, qint64 value)
+  {
+    uchar buf[8];
+    qToBigEndian<qint64>(value, buf);
+    out.append(reinterpret_cast<const char*>(buf), 8);
+  }
+
+  quint32 readBE32(const char* in)
+  {
+    return qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(in));
+  }
+
+  qint64 readBE64(const char* in)
+  {
+    return qFromBigEndian<qint64>(reinterpret_cast<const uchar*>(in));
+  }
+
+  quint32 chunkCrc(const char* data, int size)
+  {
+    const uLong crc = crc32(0L, Z_NULL, 0);
+    return static_cast<quint32>(crc32(crc, reinterpret_cast<const Bytef*>(data), size));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct QtMosquittoStreamSender::data
+{
+  QtMosquittoClient* client;
+  QtMosquittoTopic topic;
+  QIODevice* source;
+  int chunkSize;
+  int qos;
+  int window;
+  quint32 streamId;
+  quint32 nextSeq;
+  qint64 total;
+  qint64 sent;
+  QCryptographicHash hash;
+  QSet<int> outstanding;
+  // Messages reported as published before publish() returned their ID
+  QSet<int> early;
+  bool sending;
+  bool sourceClosed;
+  bool sourceDone;
+  bool endSent;
+  bool started;
+  bool finished;
+
+  data():client(0),topic(),source(0),chunkSize(0),qos(0),window(0),streamId(0),nextSeq(0),total(-1),sent(0),
+    hash(QCryptographicHash::Sha256),outstanding(),early(),sending(false),sourceClosed(false),sourceDone(false),
+    endSent(false),started(false),finished(false){}
+};
+
+
+QtMosquittoStreamSender::QtMosquittoStreamSender(QtMosquittoClient* client, const QtMosquittoTopic& topic, QIODevice* source,
+                                                 int chunkSize, int qos, int window, QObject* par) :
+  QObject(par),
+  d(new data())
+{
+  d->client = client;
+  d->topic = topic;
+  d->source = source;
+  d->chunkSize = qMax(1, chunkSize);
+  d->qos = qBound(0, qos, 2);
+  d->window = qMax(1, window);
+  std::random_device random;
+  d->streamId = random();
+}
+
+QtMosquittoStreamSender::~QtMosquittoStreamSender()
+{
+  delete d;
+  d = 0;
+}
+
+bool QtMosquittoStreamSender::start()
+{
+  if (d->started)
+  {
+    qWarning() << "QtMosquittoStreamSender::start: Already started";
+    return false;
+  }
+  if (!d->client || !d->topic.isValid())
+  {
+    qWarning() << "QtMosquittoStreamSender::start: Invalid client or topic";
+    return false;
+  }
+  if (!d->source || !d->source->isReadable())
+  {
+    qWarning() << "QtMosquittoStreamSender::start: Source is not readable";
+    return false;
+  }
+  // Held messages get no ID, the sender could not tell when they complete
+  const QtMosquittoSpool* spool = d->client->spool();
+  if (d->qos > 0 && ((spool && spool->isOpen()) || !d->client->laneDepths().isEmpty()))
+  {
+    qWarning() << "QtMosquittoStreamSender::start: QoS 1 and 2 streams need the spool and priority lanes disabled";
+    return false;
+  }
+
+  d->started = true;
+  d->total = d->source->isSequential() ? -1 : d->source->size() - d->source->pos();
+  connect(d->client, SIGNAL(published(int)), this, SLOT(messagePublished(int)));
+  connect(d->client, SIGNAL(disconnected()), this, SLOT(clientDisconnected()));
+  connect(d->source, SIGNAL(readyRead()), this, SLOT(pump()));
+  connect(d->source, SIGNAL(readChannelFinished()), this, SLOT(sourceFinished()));
+
+  QByteArray manifest(header(Manifest, 0));
+  appendBE64(manifest, d->total);
+  appendBE32(manifest, static_cast<quint32>(d->chunkSize));
+  if (!send(manifest))
+  {
+    return false;
+  }
+  pump();
+  return true;
+}
+
+quint32 QtMosquittoStreamSender::streamId() const
+{
+  return d->streamId;
+}
+
+qint64 QtMosquittoStreamSender::bytesSent() const
+{
+  return d->sent;
+}
+
+bool QtMosquittoStreamSender::isFinished() const
+{
+  return d->finished;
+}
+
+void QtMosquittoStreamSender::abort()
+{
+  if (!d->started || d->finished)
+  {
+    return;
+  }
+  // Best effort, receivers also give up on a new manifest
+  d->client->publish(d->topic, header(Abort, d->nextSeq), d->qos);
+  finish(false);
+}
+
+void QtMosquittoStreamSender::pump()
+{
+  if (!d->started || d->finished)
+  {
+    return;
+  }
+
+  while (!d->sourceDone && d->outstanding.size() < d->window)
+  {
+    const QByteArray chunk(d->source->read(d->chunkSize));
+    if (chunk.isEmpty())
+    {
+      if (!d->source->isSequential() && !d->source->atEnd())
+      {
+        qWarning() << "QtMosquittoStreamSender::pump: Failed to read source:" << d->source->errorString();
+        finish(false);
+        return;
+      }
+      // Sequential devices may have more to come, wait for readyRead
+      d->sourceDone = !d->source->isSequential() || d->sourceClosed || !d->source->isOpen();
+      break;
+    }
+
+    d->hash.addData(chunk);
+    QByteArray message(header(Chunk, d->nextSeq));
+    message.reserve(chunkHeaderSize + chunk.size());
+    appendBE32(message, chunkCrc(chunk.constData(), chunk.size()));
+    message.append(chunk);
+    ++d->nextSeq;
+    d->sent += chunk.size();
+    if (!send(message))
+    {
+      return;
+    }
+    emit progress(d->sent, d->total);
+  }
+
+  // The end message follows once every chunk is out, it is what receivers verify against
+  if (d->sourceDone && !d->endSent && d->outstanding.isEmpty())
+  {
+    QByteArray end(header(End, d->nextSeq));
+    appendBE64(end, d->sent);
+    end.append(d->hash.result());
+    d->endSent = true;
+    if (!send(end))
+    {
+      return;
+    }
+  }
+  if (d->endSent && d->outstanding.isEmpty())
+  {
+    finish(true);
+  }
+}
+
+void QtMosquittoStreamSender::sourceFinished()
+{
+  d->sourceClosed = true;
+  pump();
+}
+
+void QtMosquittoStreamSender::messagePublished(int mid)
+{
+  if (d->sending)
+  {
+    d->early.insert(mid);
+    return;
+  }
+  if (d->outstanding.remove(mid))
+  {
+    pump();
+  }
+}
+
+void QtMosquittoStreamSender::clientDisconnected()
+{
+  // QoS 0 messages in flight are lost with the connection and never reported as published
+  if (d->qos == 0 && !d->outstanding.isEmpty())
+  {
+    qWarning() << "QtMosquittoStreamSender::clientDisconnected: Lost" << d->outstanding.size() << "stream messages";
+    finish(false);
+  }
+}
+
+QByteArray QtMosquittoStreamSender::header(MessageType type, quint32 seq) const
+{
+  QByteArray out;
+  out.reserve(HeaderSize);
+  out.append('Q');
+  out.append('S');
+  out.append(streamVersion);
+  out.append(static_cast<char>(type));
+  appendBE32(out, d->streamId);
+  appendBE32(out, seq);
+  return out;
+}
+
+bool QtMosquittoStreamSender::send(const QByteArray& message)
+{
+  d->sending = true;
+  const int mid = d->client->publish(d->topic, message, d->qos);
+  d->sending = false;
+  if (mid < 0)
+  {
+    qWarning() << "QtMosquittoStreamSender::send: Failed to publish stream message" << mid;
+    d->early.clear();
+    finish(false);
+    return false;
+  }
+  // A held message has no ID, so its completion could never be confirmed
+  if (mid == QtMosquittoClient::PublishQueued)
+  {
+    qWarning() << "QtMosquittoStreamSender::send: Stream message held by the spool or a priority lane";
+    d->early.clear();
+    finish(false);
+    return false;
+  }
+  if (!d->early.contains(mid))
+  {
+    d->outstanding.insert(mid);
+  }
+  d->early.clear();
+  return true;
+}
+
+void QtMosquittoStreamSender::finish(bool ok)
+{
+  if (d->finished)
+  {
+    return;
+  }
+  d->finished = true;
+  d->outstanding.clear();
+  disconnect(d->client, 0, this, 0);
+  disconnect(d->source, 0, this, 0);
+  emit finished(ok);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct QtMosquittoStreamReceiver::data
+{
+  QPointer<QtMosquittoClient> client;
+  QIODevice* sink;
+  int reorderLimit;
+  int handlerId;
+  bool active;
+  quint32 streamId;
+  qint64 total;
+  quint32 nextSeq;
+  qint64 written;
+  QCryptographicHash hash;
+  QMap<quint32, QByteArray> held;
+  bool endSeen;
+  quint32 chunkCount;
+  qint64 endSize;
+  QByteArray digest;
+
+  data():client(),sink(0),reorderLimit(0),handlerId(-1),active(false),streamId(0),total(-1),nextSeq(0),written(0),
+    hash(QCryptographicHash::Sha256),held(),endSeen(false),chunkCount(0),endSize(0),digest(){}
+};
+
+
+QtMosquittoStreamReceiver::QtMosquittoStreamReceiver(QtMosquittoClient* client, const QString& topic, QIODevice* sink,
+                                                     int qos, int reorderLimit, QObject* par) :
+  QObject(par),
+  d(new data())
+{
+  d->client = client;
+  d->sink = sink;
+  d->reorderLimit = qMax(0, reorderLimit);
+  if (!client || !sink || !sink->isWritable())
+  {
+    qWarning() << "QtMosquittoStreamReceiver: Invalid client or sink";
+    return;
+  }
+  d->handlerId = client->subscribe(topic, qos, this, [this](const QtMosquittoMessage& msg) { handle(msg); });
+}
+
+QtMosquittoStreamReceiver::~QtMosquittoStreamReceiver()
+{
+  if (d->client && d->handlerId >= 0)
+  {
+    d->client->unsubscribe(d->handlerId);
+  }
+  delete d;
+  d = 0;
+}
+
+bool QtMosquittoStreamReceiver::isValid() const
+{
+  return d->handlerId >= 0;
+}
+
+qint64 QtMosquittoStreamReceiver::bytesReceived() const
+{
+  return d->written;
+}
+
+void QtMosquittoStreamReceiver::handle(const QtMosquittoMessage& msg)
+{
+  const QByteArray& payload = msg.payload();
+  const char* p = payload.constData();
+  if (payload.size() < QtMosquittoStreamSender::HeaderSize || p[0] != 'Q' || p[1] != 'S')
+  {
+    return;
+  }
+  if (p[2] != streamVersion)
+  {
+    qWarning() << "QtMosquittoStreamReceiver: Unsupported stream version" << int(p[2]);
+    return;
+  }
+  const int type = p[3];
+  const quint32 id = readBE32(p + 4);
+  const quint32 seq = readBE32(p + 8);
+
+  if (type == QtMosquittoStreamSender::Manifest)
+  {
+    if (payload.size() < manifestSize || (d->active && id == d->streamId))
+    {
+      return;
+    }
+    if (d->active)
+    {
+      fail("superseded by a new stream");
+    }
+    d->active = true;
+    d->streamId = id;
+    d->total = readBE64(p + QtMosquittoStreamSender::HeaderSize);
+    d->nextSeq = 0;
+    d->written = 0;
+    d->hash.reset();
+    d->held.clear();
+    d->endSeen = false;
+    emit started(id, d->total);
+    return;
+  }
+  if (!d->active || id != d->streamId)
+  {
+    return;
+  }
+
+  switch (type)
+  {
+    case QtMosquittoStreamSender::Chunk:
+    {
+      if (payload.size() < chunkHeaderSize)
+      {
+        fail("truncated chunk");
+        return;
+      }
+      const QByteArray chunk(payload.mid(chunkHeaderSize));
+      if (readBE32(p + QtMosquittoStreamSender::HeaderSize) != chunkCrc(chunk.constData(), chunk.size()))
+      {
+        fail("chunk CRC mismatch");
+        return;
+      }
+      if (seq < d->nextSeq || d->held.contains(seq))
+      {
+        // Redelivered after a reconnect
+        return;
+      }
+      if (seq != d->nextSeq)
+      {
+        if (d->held.size() >= d->reorderLimit)
+        {
+          fail("too many chunks out of order");
+          return;
+        }
+        d->held.insert(seq, chunk);
+        return;
+      }
+      if (!writeChunk(chunk))
+      {
+        return;
+      }
+      while (!d->held.isEmpty() && d->held.firstKey() == d->nextSeq)
+      {
+        if (!writeChunk(d->held.take(d->nextSeq)))
+        {
+          return;
+        }
+      }
+      emit progress(d->written, d->total);
+      checkComplete();
+      break;
+    }
+    case QtMosquittoStreamSender::End:
+      if (payload.size() < endMessageSize)
+      {
+        fail("truncated end message");
+        return;
+      }
+      d->endSeen = true;
+      d->chunkCount = seq;
+      d->endSize = readBE64(p + QtMosquittoStreamSender::HeaderSize);
+      d->digest = payload.mid(QtMosquittoStreamSender::HeaderSize + 8, digestSize);
+      checkComplete();
+      break;
+    case QtMosquittoStreamSender::Abort:
+      fail("aborted by sender");
+      break;
+    default:
+      break;
+  }
+}
+
+bool QtMosquittoStreamReceiver::writeChunk(const QByteArray& chunk)
+{
+  if (d->sink->write(chunk) != chunk.size())
+  {
+    fail("failed to write sink");
+    return false;
+  }
+  d->hash.addData(chunk);
+  d->written += chunk.size();
+  ++d->nextSeq;
+  return true;
+}
+
+void QtMosquittoStreamReceiver::checkComplete()
+{
+  if (!d->active || !d->endSeen || d->nextSeq != d->chunkCount)
+  {
+    return;
+  }
+  if (d->written != d->endSize || d->hash.result() != d->digest)
+  {
+    fail("size or SHA-256 mismatch");
+    return;
+  }
+  d->active = false;
+  d->held.clear();
+  emit finished(d->streamId, true);
+}
+
+void QtMosquittoStreamReceiver::fail(const char* reason)
+{
+  qWarning() << "QtMosquittoStreamReceiver: Stream" << d->streamId << "failed:" << reason;
+  d->active = false;
+  d->held.clear();
+  emit finished(d->streamId, false);
+}
@@ -0,0 +1,178 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#ifndef QTMOSQUITTOSTREAM_HPP
+#define QTMOSQUITTOSTREAM_HPP
+
+#include "qtmosquitto.hpp"
+
+/** Publish the contents of a QIODevice as a stream of chunk messages.
+ * A stream is a manifest, the chunks in sequence and an end message, all
+ * published to the same topic. Every message starts with a 12 byte header,
+ * the bytes 'Q' 'S', the format version, the message type, the stream ID and
+ * a sequence number, big endian. Each chunk carries the CRC-32 of its data
+ * and the end message carries the total size and the SHA-256 of the whole
+ * stream.
+ * Only a window of chunks is read from the device and handed to the client
+ * at a time, the next chunk is read once the client reports an earlier one as
+ * published, so memory use does not depend on the size of the stream.
+ * finished(true) is only emitted once every message has been published, so
+ * QoS 1 and 2 streams can not start while the client has the spool or
+ * priority lanes enabled, which hold messages without a message ID, and a
+ * stream fails if one of its messages is held anyway. A QoS 0 stream fails
+ * if the connection is lost with messages still in flight.
+ * \sa QtMosquittoStreamReceiver, QtMosquittoClient::publishStream
+ */
+class QTMOSQUITTO_EXPORT QtMosquittoStreamSender : public QObject
+{
+  Q_OBJECT
+  public:
+    /// Message types in the header of stream messages.
+    enum MessageType
+    {
+      Manifest = 0,
+      Chunk = 1,
+      End = 2,
+      Abort = 3
+    };
+
+    /// Size of the header in front of every stream message.
+    enum { HeaderSize = 12 };
+
+    /** Create the sender, nothing is published until start() is called.
+     * \param client     Client to publish with, must outlive the sender.
+     * \param topic      Topic the stream is published to.
+     * \param source     Open device to read from, it is not owned by the
+     *                   sender. Sequential devices end once they have
+     *                   emitted readChannelFinished() and every byte has
+     *                   been read.
+     * \param chunkSize  Largest number of bytes in one chunk.
+     * \param qos        Message QoS level of every message.
+     * \param window     Number of messages handed to the client and not yet
+     *                   published.
+     * \param parent     QObject parent.
+     */
+    QtMosquittoStreamSender(QtMosquittoClient* client, const QtMosquittoTopic& topic, QIODevice* source,
+                            int chunkSize = 65536, int qos = 1, int window = 8, QObject* parent = 0);
+
+    /// Release resources, an unfinished stream is not aborted.
+    virtual ~QtMosquittoStreamSender();
+
+    /** Publish the manifest and start sending chunks.
+     * \returns True if the stream started, false otherwise.
+     */
+    bool start();
+
+    /// Random ID of this stream, carried by each of its messages.
+    quint32 streamId() const;
+
+    /// Number of bytes read from the device and published so far.
+    qint64 bytesSent() const;
+
+    /// True once finished() has been emitted.
+    bool isFinished() const;
+
+  public slots:
+    /// Stop sending and tell receivers the stream was abandoned.
+    void abort();
+
+  signals:
+    /** Emitted after each chunk has been handed to the client.
+     * \param bytes  Bytes sent so far.
+     * \param total  Size of the stream, or -1 if the device is sequential.
+     */
+    void progress(qint64 bytes, qint64 total);
+
+    /** Emitted once the end message has been published, or on failure.
+     * \param ok  True if every message was published.
+     */
+    void finished(bool ok);
+
+  private slots:
+    void pump();
+    void sourceFinished();
+    void messagePublished(int mid);
+    void clientDisconnected();
+
+  private:
+    QByteArray header(MessageType type, quint32 seq) const;
+    bool send(const QByteArray& message);
+    void finish(bool ok);
+    struct data;
+    data* d;
+    Q_DISABLE_COPY(QtMosquittoStreamSender)
+};
+
+
+/** Reassemble streams published by QtMosquittoStreamSender into a device.
+ * Chunks are written to the sink as soon as they are next in sequence, only
+ * chunks arriving ahead of a missing one are held in memory. A chunk with a
+ * bad CRC-32, a gap wider than the reorder limit, or a size or SHA-256 that
+ * do not match the end message fail the stream.
+ */
+class QTMOSQUITTO_EXPORT QtMosquittoStreamReceiver : public QObject
+{
+  Q_OBJECT
+  public:
+    /** Create the receiver and subscribe to the stream topic.
+     * \param client        Client to subscribe with.
+     * \param topic         Topic streams are published to.
+     * \param sink          Open device the data is written to, it is not
+     *                      owned by the receiver.
+     * \param qos           QoS of the subscription.
+     * \param reorderLimit  Most chunks held while waiting for a missing one.
+     * \param parent        QObject parent.
+     */
+    QtMosquittoStreamReceiver(QtMosquittoClient* client, const QString& topic, QIODevice* sink,
+                              int qos = 1, int reorderLimit = 16, QObject* parent = 0);
+
+    /// Remove the subscription and release resources.
+    virtual ~QtMosquittoStreamReceiver();
+
+    /// True if the subscription was made.
+    bool isValid() const;
+
+    /// Bytes of the current or last stream written to the sink.
+    qint64 bytesReceived() const;
+
+  signals:
+    /** Emitted when the manifest of a stream is received.
+     * \param streamId  ID of the stream.
+     * \param total     Size of the stream, or -1 if unknown to the sender.
+     */
+    void started(quint32 streamId, qint64 total);
+
+    /// Emitted after chunks have been written to the sink.
+    void progress(qint64 bytes, qint64 total);
+
+    /** Emitted when a stream ends.
+     * \param streamId  ID of the stream.
+     * \param ok        True if every chunk was received and the checks
+     *                  passed, false if the stream failed or was aborted.
+     */
+    void finished(quint32 streamId, bool ok);
+
+  private:
+    void handle(const QtMosquittoMessage& msg);
+    bool writeChunk(const QByteArray& chunk);
+    void checkComplete();
+    void fail(const char* reason);
+    struct data;
+    data* d;
+    Q_DISABLE_COPY(QtMosquittoStreamReceiver)
+};
+
+#endif
@@ -0,0 +1,165 @@
+/*
+Copyright (c) 2015 Silas Parker <skyhisi@gmail.com>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Silas Parker
+*/
+
+#include <QtCore>
+
+#include "../qtmosquittospool.hpp"
+
+namespace
+{
+  struct Expected
+  {
+    QByteArray topic;
+    QByteArray payload;
+  };
+
+  QByteArray topicFor(int i)
+  {
+    return QByteArray("spool/test/") + QByteArray::number(i);
+  }
+
+  /// Payload sizes vary so wrapped records leave stale record bytes behind.
+  QByteArray payloadFor(int i)
+  {
+    return QByteArray(40 + (i * 37) % 90, static_cast<char>('a' + i % 26));
+  }
+
+  /// Check the number of messages in the spool.
+  bool countMatches(const QtMosquittoSpool& spool, const QQueue<Expected>& expected, const char* stage)
+  {
+    if (spool.count() != expected.size())
+    {
+      qWarning() << stage << "count" << spool.count() << "expected" << expected.size();
+      return false;
+    }
+    return true;
+  }
+
+  /// Pop every message and compare it with the expected ones, oldest first.
+  bool drain(QtMosquittoSpool& spool, QQueue<Expected> expected, const char* stage)
+  {
+    if (!countMatches(spool, expected, stage))
+    {
+      return false;
+    }
+    while (!expected.isEmpty())
+    {
+      const Expected want(expected.dequeue());
+      const QtMosquittoMessage got(spool.peek());
+      if (got.topic() != want.topic || got.payload() != want.payload || got.qos() != 1)
+      {
+        qWarning() << stage << "read" << got.topic() << "expected" << want.topic;
+        return false;
+      }
+      spool.pop();
+    }
+    if (!spool.isEmpty())
+    {
+      qWarning() << stage << "messages left after draining" << spool.count();
+      return false;
+    }
+    return true;
+  }
+
+  /// Append far past the capacity with DropOldest, so appends drop records and wrap.
+  bool fill(QtMosquittoSpool& spool, int first, int last, QQueue<Expected>& expected)
+  {
+    for (int i = first; i < last; ++i)
+    {
+      const quint64 dropped = spool.dropped();
+      Expected message;
+      message.topic = topicFor(i);
+      message.payload = payloadFor(i);
+      if (!spool.append(message.topic, message.payload, 1, false))
+      {
+        qWarning() << "fill: Failed to append" << i;
+        return false;
+      }
+      for (quint64 n = dropped; n < spool.dropped(); ++n)
+      {
+        expected.dequeue();
+      }
+      expected.enqueue(message);
+      if (!countMatches(spool, expected, "fill"))
+      {
+        return false;
+      }
+    }
+    if (spool.dropped() == 0)
+    {
+      qWarning() << "fill: Nothing was dropped";
+      return false;
+    }
+    return true;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  QCoreApplication app(argc, argv);
+  QTemporaryDir dir;
+  if (!dir.isValid())
+  {
+    qWarning() << "Failed to create a temporary directory";
+    return 1;
+  }
+  const QString fileName(dir.filePath("test.spool"));
+  QtMosquittoSpool spool;
+  QQueue<Expected> expected;
+
+  // Read back in the same session as the appends
+  if (!spool.open(fileName, 1000))
+  {
+    qWarning() << "Failed to open" << fileName;
+    return 1;
+  }
+  spool.setOverflowPolicy(QtMosquittoSpool::DropOldest);
+  if (!fill(spool, 0, 200, expected))
+  {
+    return 1;
+  }
+  for (int i = 0; i < 3; ++i)
+  {
+    spool.pop();
+    expected.dequeue();
+  }
+  if (!fill(spool, 200, 300, expected) || !drain(spool, expected, "live"))
+  {
+    return 1;
+  }
+
+  // Read back after reopening, every record must check out and be in order
+  expected.clear();
+  if (!fill(spool, 300, 500, expected))
+  {
+    return 1;
+  }
+  spool.close();
+  if (!spool.open(fileName) || !drain(spool, expected, "reopen"))
+  {
+    return 1;
+  }
+  spool.close();
+
+  // A drained spool stays empty after reopening
+  if (!spool.open(fileName) || !spool.isEmpty())
+  {
+    qWarning() << "Drained spool is not empty after reopening";
+    return 1;
+  }
+  spool.close();
+  return 0;
+}